@@ -27,6 +27,9 @@ MODULE_PARM_DESC(scull_qset, "How large should the qset be?");
 module_param(scull_quantum, int, 0444);
 MODULE_PARM_DESC(scull_quantum, "How large should the quantum be?");
 
+module_param(scull_backing, charp, 0444);
+MODULE_PARM_DESC(scull_backing, "Absolute path of the file the scull devices are restored from at load and checkpointed to (SCULL_IOCCHECKPOINT)");
+
 
 struct class * cls;
 struct scull_dev *scull_devices;
@@ -100,10 +103,18 @@ static int __init short_init(void) {
 		device->qset    = scull_qset;
 		device->size    = 0;
 		device->data    = NULL;
+		device->template = NULL;
+		device->frozen   = NULL;
+		device->mem      = 0;
+		device->mem_pool = NULL;
 		sema_init(&device->sem, 1);
 		scull_setup_cdev(device, i);
 		device_create(cls, NULL, MKDEV(scull_major, scull_minor + i), NULL, "scull%d", i);
 	}
+	// warm start: what the last SCULL_IOCCHECKPOINT saved
+	result = scull_restore(scull_devices, scull_nr_devs);
+	if (result)
+		pr_warn("scull: restore from %s failed (%d), devices start empty\n", scull_backing, result);
 
 	return 0;
 
@@ -145,4 +145,8 @@ log "Seek to 0 and read 5"
 out=$(${SUDO_BIN:+sudo} "$BIN" -d "$DEV" --seek 0 --read 5 | awk -F': ' '/^Read [0-9]+ bytes:/ {print $2; exit}')
 [[ "$out" == "$msg" ]] || { echo "FAIL: readback expected '$msg', got '$out'"; exit 5; }
 
+# 6) Batched submission: many records in one ioctl each way
+log "Batch write/read 256 records"
+${SUDO_BIN:+sudo} "$BIN" -d "$DEV" --batch 256 | grep -q "^Batch: 256 records OK" || { echo "FAIL: batch"; exit 6; }
+
 log "All smoke tests passed"
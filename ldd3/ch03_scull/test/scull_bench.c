@@ -0,0 +1,329 @@
+// scull_bench.c — throughput/latency benchmark and stress tool for scull
+// Build: gcc -Wall -Wextra -O2 -pthread -o scull_bench scull_bench.c
+// Usage examples:
+//   ./scull_bench -d /dev/scull0 -t 4 -s 512 -T 5                # 4 threads, 512 B records, seq writes
+//   ./scull_bench -d /dev/scull0 -t 8 -s 64 --random --mix 70    # 70% reads, random offsets
+//   ./scull_bench -d /dev/scull0 -s 16 --batch 64                # 64 records per SCULL_IOCBATCH
+//   ./scull_bench -d /dev/scullv0 --mmap                          # memcpy through an mmap (scullv)
+//
+// Every run prints one summary line of key=value pairs, so two runs (before/after a change)
+// can be compared with a plain diff; --csv prints the same values as a CSV row.
+//
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scull.h"
+
+static const char *devpath = "/dev/scull0";
+static int nthreads = 1;
+static size_t rec_size = 4096;
+static size_t span = 4 << 20;        // bytes of the device the run touches
+static double seconds = 3.0;
+static long ops_per_thread = 0;      // if set, run this many ops instead of for `seconds`
+static int random_off = 0;
+static int read_pct = 0;             // 0: all writes, 100: all reads
+static int use_append = 0;
+static int use_mmap = 0;
+static int batch = 0;                // records per SCULL_IOCBATCH, 0: one syscall per record
+static int csv = 0;
+
+// latency histogram, log-linear: every power of two [2^e, 2^(e+1)) ns is split into LAT_SUB
+// equal sub-buckets (below LAT_SUB ns one bucket per ns), so a bucket is at most 1/8 wide and
+// a regression well under 2x still moves the percentiles. Up to 2^LAT_MAX_LOG2 ns.
+#define LAT_SUB_LOG2 3
+#define LAT_SUB (1 << LAT_SUB_LOG2)
+#define LAT_MAX_LOG2 48
+#define LAT_BUCKETS ((LAT_MAX_LOG2 - LAT_SUB_LOG2 + 1) * LAT_SUB)
+
+struct worker {
+    pthread_t tid;
+    int id;
+    int fd;
+    char *map;
+    uint64_t ops, bytes, errors;
+    uint64_t lat[LAT_BUCKETS];
+    unsigned int seed;
+};
+
+static volatile int stop;
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int lat_bucket(uint64_t ns) {
+    int e, b;
+    if (ns < LAT_SUB) return (int)ns;
+    e = 63 - __builtin_clzll(ns);
+    b = (e - LAT_SUB_LOG2 + 1) * LAT_SUB + (int)((ns >> (e - LAT_SUB_LOG2)) & (LAT_SUB - 1));
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+// [lo, lo + width) ns covered by bucket b
+static void lat_range(int b, uint64_t *lo, uint64_t *width) {
+    int e = b / LAT_SUB + LAT_SUB_LOG2 - 1;
+    if (b < LAT_SUB) {
+        *lo = b;
+        *width = 1;
+        return;
+    }
+    *width = 1ull << (e - LAT_SUB_LOG2);
+    *lo = (uint64_t)(LAT_SUB + b % LAT_SUB) << (e - LAT_SUB_LOG2);
+}
+
+static void record_lat(struct worker *w, uint64_t ns) {
+    w->lat[lat_bucket(ns)]++;
+}
+
+// offset of a thread's i-th record: each thread owns a slice of the span when sequential
+static off_t next_off(struct worker *w, uint64_t i) {
+    size_t nrec = span / rec_size;
+    if (random_off)
+        return (off_t)(rand_r(&w->seed) % nrec) * rec_size;
+    size_t slice = nrec / nthreads ? nrec / nthreads : 1;
+    return (off_t)((w->id * slice + i % slice) % nrec) * rec_size;
+}
+
+static int is_read(struct worker *w) {
+    return read_pct >= 100 || (read_pct > 0 && (int)(rand_r(&w->seed) % 100) < read_pct);
+}
+
+static int one_op(struct worker *w, char *buf, uint64_t i) {
+    off_t off = next_off(w, i);
+    ssize_t n;
+
+    if (use_mmap) {
+        if (is_read(w)) memcpy(buf, w->map + off, rec_size);
+        else memcpy(w->map + off, buf, rec_size);
+        return 1;
+    }
+    if (is_read(w))
+        n = pread(w->fd, buf, rec_size, off);
+    else if (use_append)
+        n = write(w->fd, buf, rec_size);
+    else
+        n = pwrite(w->fd, buf, rec_size, off);
+    return n < 0 ? -1 : 1;
+}
+
+static int batch_op(struct worker *w, char *buf, uint64_t i, struct scull_sqe *sqe, struct scull_cqe *cqe) {
+    struct scull_batch b = { .sqes = (__u64)(uintptr_t)sqe, .cqes = (__u64)(uintptr_t)cqe, .nr = (__u32)batch };
+    for (int k = 0; k < batch; k++) {
+        sqe[k].op = is_read(w) ? SCULL_OP_READ : SCULL_OP_WRITE;
+        sqe[k].len = (__u32)rec_size;
+        sqe[k].off = (__u64)next_off(w, i + k);
+        sqe[k].buf = (__u64)(uintptr_t)(buf + (size_t)k * rec_size);
+        sqe[k].user_data = k;
+    }
+    int ret = ioctl(w->fd, SCULL_IOCBATCH, &b);
+    if (ret < 0) return -1;
+    for (int k = 0; k < ret; k++)
+        if (cqe[k].res < 0) w->errors++;
+    return ret;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    size_t bufsz = rec_size * (batch ? batch : 1);
+    char *buf = malloc(bufsz);
+    struct scull_sqe *sqe = batch ? calloc(batch, sizeof(*sqe)) : NULL;
+    struct scull_cqe *cqe = batch ? calloc(batch, sizeof(*cqe)) : NULL;
+    if (!buf || (batch && (!sqe || !cqe))) die("malloc");
+    memset(buf, 'a' + w->id % 26, bufsz);
+
+    for (uint64_t i = 0; !stop && (!ops_per_thread || w->ops < (uint64_t)ops_per_thread); ) {
+        uint64_t t0 = now_ns();
+        int n = batch ? batch_op(w, buf, i, sqe, cqe) : one_op(w, buf, i);
+        uint64_t t1 = now_ns();
+        if (n < 0) {
+            w->errors++;
+            if (w->errors > 1000) { fprintf(stderr, "thread %d: too many errors: %s\n", w->id, strerror(errno)); break; }
+            continue;
+        }
+        // a batch is one latency sample per record: its syscall time spread over them
+        for (int k = 0; k < n; k++) record_lat(w, (t1 - t0) / n);
+        w->ops += n;
+        w->bytes += (uint64_t)n * rec_size;
+        i += n;
+    }
+    free(buf); free(sqe); free(cqe);
+    return NULL;
+}
+
+// fill the span once so reads hit data, not holes
+static void prefill(int fd) {
+    char *buf = malloc(rec_size);
+    if (!buf) die("malloc");
+    memset(buf, 'p', rec_size);
+    for (size_t off = 0; off + rec_size <= span; off += rec_size)
+        if (pwrite(fd, buf, rec_size, (off_t)off) != (ssize_t)rec_size) die("prefill");
+    free(buf);
+}
+
+// the p-quantile, interpolated linearly inside the bucket it falls in
+static uint64_t percentile(const uint64_t *lat, uint64_t total, double p) {
+    double want = total * p;
+    uint64_t seen = 0, lo, width;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        if (lat[b] && seen + lat[b] > want) {
+            lat_range(b, &lo, &width);
+            return lo + (uint64_t)(width * ((want - seen) / lat[b]));
+        }
+        seen += lat[b];
+    }
+    lat_range(LAT_BUCKETS - 1, &lo, &width);
+    return lo + width;
+}
+
+static void print_help(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -d, --device PATH     Device node (default: /dev/scull0)\n"
+        "  -t, --threads N       Worker threads, each with its own fd (default 1)\n"
+        "  -s, --size BYTES      Record size (default 4096)\n"
+        "      --span BYTES      Device bytes touched (default 4 MiB)\n"
+        "  -T, --time SEC        Run time (default 3)\n"
+        "  -n, --ops N           Ops per thread instead of a run time\n"
+        "      --random          Random record offsets (default sequential)\n"
+        "      --mix PCT         Percent of reads, the rest are writes (default 0)\n"
+        "      --append          Open with O_APPEND, writes use write() instead of pwrite()\n"
+        "      --mmap            memcpy through mmap of the span (device must support mmap)\n"
+        "      --batch N         N records per SCULL_IOCBATCH call\n"
+        "      --csv             Print the summary as a CSV header + row\n"
+        "  -h, --help            Show this help\n",
+        prog);
+}
+
+int main(int argc, char **argv) {
+    static struct option opts[] = {
+        {"device",  required_argument, 0, 'd'},
+        {"threads", required_argument, 0, 't'},
+        {"size",    required_argument, 0, 's'},
+        {"time",    required_argument, 0, 'T'},
+        {"ops",     required_argument, 0, 'n'},
+        {"span",    required_argument, 0,  1 },
+        {"random",  no_argument,       0,  2 },
+        {"mix",     required_argument, 0,  3 },
+        {"append",  no_argument,       0,  4 },
+        {"mmap",    no_argument,       0,  5 },
+        {"batch",   required_argument, 0,  6 },
+        {"csv",     no_argument,       0,  7 },
+        {"help",    no_argument,       0, 'h'},
+        {0,0,0,0}
+    };
+    int c, idx;
+    while ((c = getopt_long(argc, argv, "d:t:s:T:n:h", opts, &idx)) != -1) {
+        switch (c) {
+            case 'd': devpath = optarg; break;
+            case 't': nthreads = atoi(optarg); break;
+            case 's': rec_size = strtoul(optarg, NULL, 0); break;
+            case 'T': seconds = atof(optarg); break;
+            case 'n': ops_per_thread = strtol(optarg, NULL, 0); break;
+            case 1:   span = strtoul(optarg, NULL, 0); break;
+            case 2:   random_off = 1; break;
+            case 3:   read_pct = atoi(optarg); break;
+            case 4:   use_append = 1; break;
+            case 5:   use_mmap = 1; break;
+            case 6:   batch = atoi(optarg); break;
+            case 7:   csv = 1; break;
+            case 'h': print_help(argv[0]); return 0;
+            default:  print_help(argv[0]); return 2;
+        }
+    }
+    if (nthreads < 1 || rec_size == 0 || span < rec_size || read_pct < 0 || read_pct > 100 || batch < 0) {
+        print_help(argv[0]);
+        return 2;
+    }
+    if (batch && (use_mmap || use_append)) {
+        fprintf(stderr, "--batch cannot be combined with --mmap or --append\n");
+        return 2;
+    }
+
+    // setup: fill the span through a separate fd (O_RDWR: an O_WRONLY open would truncate)
+    int fd = open(devpath, O_RDWR);
+    if (fd < 0) die("open");
+    if (read_pct > 0 || use_mmap) prefill(fd);
+    close(fd);
+
+    struct worker *w = calloc(nthreads, sizeof(*w));
+    if (!w) die("calloc");
+    for (int i = 0; i < nthreads; i++) {
+        w[i].id = i;
+        w[i].seed = 0x5c011 + i;
+        w[i].fd = open(devpath, O_RDWR | (use_append ? O_APPEND : 0));
+        if (w[i].fd < 0) die("open");
+        if (use_mmap) {
+            w[i].map = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_SHARED, w[i].fd, 0);
+            if (w[i].map == MAP_FAILED) die("mmap (does this device support mmap?)");
+        }
+    }
+
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_SELF, &ru0);
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < nthreads; i++)
+        if (pthread_create(&w[i].tid, NULL, worker_main, &w[i])) die("pthread_create");
+    if (!ops_per_thread) {
+        struct timespec d = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+        nanosleep(&d, NULL);
+        stop = 1;
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(w[i].tid, NULL);
+    uint64_t elapsed = now_ns() - t0;
+    getrusage(RUSAGE_SELF, &ru1);
+
+    uint64_t ops = 0, bytes = 0, errors = 0, lat[LAT_BUCKETS] = {0};
+    for (int i = 0; i < nthreads; i++) {
+        ops += w[i].ops;
+        bytes += w[i].bytes;
+        errors += w[i].errors;
+        for (int b = 0; b < LAT_BUCKETS; b++) lat[b] += w[i].lat[b];
+        if (use_mmap) munmap(w[i].map, span);
+        close(w[i].fd);
+    }
+    double cpu_ns = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec + ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) * 1e9 +
+                    (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec + ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) * 1e3;
+    double secs = elapsed / 1e9;
+    double mbps = bytes / secs / (1 << 20);
+    double kops = ops / secs / 1e3;
+    double cpb = bytes ? cpu_ns / bytes : 0;
+    uint64_t p50 = percentile(lat, ops, 0.50), p99 = percentile(lat, ops, 0.99);
+    const char *mode = use_mmap ? "mmap" : batch ? "batch" : use_append ? "append" : "rw";
+
+    if (csv) {
+        printf("device,mode,threads,size,pattern,read_pct,secs,ops,errors,MBps,kops,p50_ns,p99_ns,cpu_ns_per_byte\n");
+        printf("%s,%s,%d,%zu,%s,%d,%.3f,%llu,%llu,%.2f,%.2f,%llu,%llu,%.3f\n",
+               devpath, mode, nthreads, rec_size, random_off ? "random" : "seq", read_pct, secs,
+               (unsigned long long)ops, (unsigned long long)errors, mbps, kops,
+               (unsigned long long)p50, (unsigned long long)p99, cpb);
+    } else {
+        printf("device=%s mode=%s threads=%d size=%zu pattern=%s read_pct=%d secs=%.3f ops=%llu errors=%llu "
+               "MBps=%.2f kops=%.2f p50_ns=%llu p99_ns=%llu cpu_ns_per_byte=%.3f\n",
+               devpath, mode, nthreads, rec_size, random_off ? "random" : "seq", read_pct, secs,
+               (unsigned long long)ops, (unsigned long long)errors, mbps, kops,
+               (unsigned long long)p50, (unsigned long long)p99, cpb);
+    }
+    free(w);
+    return errors ? 1 : 0;
+}
@@ -5,6 +5,7 @@
 //   ./test_scull -d /dev/scull0 --set-quantum 4096 --get-quantum
 //   ./test_scull -d /dev/scull0 --write "hello" --seek 0 --read 5
 //   ./test_scull --set-qset 1000 --get-qset
+//   ./test_scull -d /dev/scull0 --batch 64
 //
 // Notes:
 // - Requires scull_ioctl.h in the include path (same dir as this file is fine).
@@ -18,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -47,10 +49,54 @@ static void print_help(const char *prog) {
         "      --seek OFF[:WHENCE]    lseek to OFF (bytes); WHENCE=0|1|2 (default 0)\n"
         "      --append               Open with O_APPEND\n"
         "      --trunc                Open with O_TRUNC (when O_WRONLY/O_RDWR)\n"
+        "      --batch N              Write N records, read them back, each with one SCULL_IOCBATCH\n"
+        "      --checkpoint           SCULL_IOCCHECKPOINT (module loaded with scull_backing=FILE)\n"
         "      --help                 Show this help\n",
         prog);
 }
 
+#define REC_SIZE 16
+
+/* Write nrec records with one SCULL_IOCBATCH, read them back with another and compare */
+static void run_batch(int fd, long nrec) {
+    struct scull_sqe *sqe = calloc(nrec, sizeof(*sqe));
+    struct scull_cqe *cqe = calloc(nrec, sizeof(*cqe));
+    char *out = calloc(nrec, REC_SIZE), *in = calloc(nrec, REC_SIZE);
+    struct scull_batch batch = { .nr = (__u32)nrec, .flags = SCULL_BATCH_STOP };
+    if (!sqe || !cqe || !out || !in) die("calloc");
+    batch.sqes = (__u64)(uintptr_t)sqe;
+    batch.cqes = (__u64)(uintptr_t)cqe;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (long i = 0; i < nrec; i++) {
+            snprintf(out + i * REC_SIZE, REC_SIZE, "rec%06ld", i);
+            sqe[i].op = pass ? SCULL_OP_READ : SCULL_OP_WRITE;
+            sqe[i].len = REC_SIZE;
+            sqe[i].off = (__u64)i * REC_SIZE;
+            sqe[i].buf = (__u64)(uintptr_t)((pass ? in : out) + i * REC_SIZE);
+            sqe[i].user_data = (__u64)i;
+        }
+        int ret = ioctl(fd, SCULL_IOCBATCH, &batch);
+        if (ret < 0) die("ioctl(SCULL_IOCBATCH)");
+        if (ret != nrec) {
+            fprintf(stderr, "Batch %s: %d of %ld completed\n", pass ? "read" : "write", ret, nrec);
+            exit(EXIT_FAILURE);
+        }
+        for (long i = 0; i < nrec; i++) {
+            if (cqe[i].user_data != (__u64)i || cqe[i].res != REC_SIZE) {
+                fprintf(stderr, "Batch %s: entry %ld res %lld\n", pass ? "read" : "write", i, (long long)cqe[i].res);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (memcmp(in, out, (size_t)nrec * REC_SIZE)) {
+        fprintf(stderr, "Batch: readback mismatch\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Batch: %ld records OK\n", nrec);
+    free(sqe); free(cqe); free(out); free(in);
+}
+
 static off_t parse_seek_arg(const char *s, int *whence_out) {
     char *colon = strchr(s, ':');
     int whence = SEEK_SET;
@@ -92,6 +138,8 @@ int main(int argc, char **argv) {
     int do_seek = 0, seek_whence = SEEK_SET;
     off_t seek_off = 0;
     int oflags = O_RDWR;
+    long batch_n = 0;
+    int want_checkpoint = 0;
 
     static struct option opts[] = {
         {"device",       required_argument, 0, 'd'},
@@ -105,6 +153,8 @@ int main(int argc, char **argv) {
         {"seek",         required_argument, 0,  8 },
         {"append",       no_argument,       0,  9 },
         {"trunc",        no_argument,       0, 10 },
+        {"batch",        required_argument, 0, 11 },
+        {"checkpoint",   no_argument,       0, 12 },
         {"help",         no_argument,       0, 'h'},
         {0,0,0,0}
     };
@@ -124,12 +174,14 @@ int main(int argc, char **argv) {
             case 8:   do_seek = 1; seek_off = parse_seek_arg(optarg, &seek_whence); break;
             case 9:   oflags |= O_APPEND; break;
             case 10:  oflags |= O_TRUNC; break;
+            case 11:  batch_n = strtol(optarg, NULL, 0); break;
+            case 12:  want_checkpoint = 1; break;
             default:  print_help(argv[0]); return 2;
         }
     }
 
     // Choose open mode: if only reading requested and no writes/ioctls that change state, allow O_RDONLY.
-    int need_write = (write_str != NULL) || have_set_quantum || have_set_qset || want_reset || (oflags & O_TRUNC) || (oflags & O_APPEND);
+    int need_write = (write_str != NULL) || have_set_quantum || have_set_qset || want_reset || (oflags & O_TRUNC) || (oflags & O_APPEND) || batch_n > 0;
     if (!need_write) oflags = O_RDONLY;
 
     int fd = open(devpath, oflags, 0666);
@@ -199,6 +251,15 @@ int main(int argc, char **argv) {
         free(buf);
     }
 
+    if (batch_n > 0)
+        run_batch(fd, batch_n);
+
+    if (want_checkpoint) {
+        ret = ioctl(fd, SCULL_IOCCHECKPOINT);
+        if (ret < 0) die("ioctl(SCULL_IOCCHECKPOINT)");
+        printf("Checkpoint: OK\n");
+    }
+
     close(fd);
     return 0;
 }
@@ -30,6 +30,27 @@ MODULE_PARM_DESC(scull_qset, "How large should the qset be?");
 module_param(scull_quantum, int, 0444);
 MODULE_PARM_DESC(scull_quantum, "How large should the quantum be?");
 
+module_param(scull_backing, charp, 0444);
+MODULE_PARM_DESC(scull_backing, "Absolute path of the file the scull devices are restored from at load and checkpointed to (SCULL_IOCCHECKPOINT)");
+
+module_param(scull_p_buffer, int, 0444);
+MODULE_PARM_DESC(scull_p_buffer, "Default scullp ring size in bytes (rounded up to a power-of-two number of pages)");
+
+module_param(scull_p_max_buffer, int, 0644);
+MODULE_PARM_DESC(scull_p_max_buffer, "Largest scullp ring size a user without CAP_SYS_RESOURCE may set");
+
+module_param(scull_p_max_busy_poll, int, 0644);
+MODULE_PARM_DESC(scull_p_max_busy_poll, "Largest scullp busy-poll budget in microseconds (0 disables busy polling)");
+
+module_param(scull_priv_max_mem, ulong, 0644);
+MODULE_PARM_DESC(scull_priv_max_mem, "Bytes all private scull instances may hold together (0 = no limit)");
+
+module_param(scull_priv_idle, int, 0644);
+MODULE_PARM_DESC(scull_priv_idle, "Seconds an unused private instance is kept before it is reclaimed (0 = keep)");
+
+module_param(scull_priv_seed, bool, 0644);
+MODULE_PARM_DESC(scull_priv_seed, "Start a private instance as a copy of the device at first open (0 = start empty)");
+
 
 extern const struct file_operations scull_fops;  // from scull.c
 struct class * cls;
@@ -39,7 +60,9 @@ static void scull_setup_cdev(struct scull_dev *dev, int index)
 	int err;
 	dev_t devno = MKDEV(scull_major, scull_minor + index);
 	// associate the cdev with file operations
-	cdev_init(&dev->cdev, &scull_fops);
+	// plain scull until an access policy is attached with SCULL_IOCTACCESS
+	scull_access_dev_init(dev, SCULL_ACCESS_NONE);
+	cdev_init(&dev->cdev, &scull_access_fops);
 	dev->cdev.owner = THIS_MODULE;
 	err = cdev_add(&dev->cdev, devno, 1);
 	if (err)
@@ -56,8 +79,9 @@ static void _scull_cleanup_module(void)
 	{
 		for (i=0; i < scull_nr_devs; i++)
 		{
-			scull_dev_reset(&scull_devices[i]);
 			cdev_del(&scull_devices[i].cdev);
+			scull_dev_reset(&scull_devices[i]);
+			scull_access_dev_cleanup(&scull_devices[i]);
 			device_destroy(cls, MKDEV(MAJOR(devno), scull_minor + i));
 		}
 		kfree(scull_devices);
@@ -105,11 +129,19 @@ static int __init short_init(void) {
 		device->qset = scull_qset;
 		device->size = 0;
 		device->data = NULL;
+		device->template = NULL;
+		device->frozen = NULL;
+		device->mem = 0;
+		device->mem_pool = NULL;
 		sema_init(&device->sem, 1);
 		scull_setup_cdev(device, i);
 		// uevent that udev uses to create /dev/scull{i}
 		device_create(cls, NULL, MKDEV(scull_major, scull_minor+i), NULL, "scull%d", i);
 	}
+	// warm start: what the last SCULL_IOCCHECKPOINT saved
+	result = scull_restore(scull_devices, scull_nr_devs);
+	if (result)
+		pr_warn("scull: restore from %s failed (%d), devices start empty\n", scull_backing, result);
 	dev = MKDEV(scull_major, scull_minor+ scull_nr_devs);
 	dev += scull_pipe_init(dev);
 	dev += scull_access_init(dev);
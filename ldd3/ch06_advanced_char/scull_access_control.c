@@ -3,245 +3,448 @@
 #include <linux/poll.h>
 #include <linux/sched.h>
 #include <linux/tty.h>
-#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/xarray.h>
 #include <linux/fcntl.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/slab.h>
 #include "scull.h"
 #include "scull_access_control.h"
 
-// scullsingle - a device that only allows one open at a time - any 2nd open returns an error
-static atomic_t scull_single_flag = ATOMIC_INIT(1);
-struct scull_dev scull_single_dev;
+/*
+ * Access policies are a layer in front of a plain scull_dev, not separate devices:
+ * any minor opened through scull_access_fops obeys the policy in its own dev->access,
+ * and SCULL_IOCTACCESS switches it at runtime.
+ *
+ * dev->access packs everything open/release needs into one 64 bit word so it can be
+ * updated with a single cmpxchg, no lock shared between devices (or even per device):
+ *   bits  0..23  open count
+ *   bits 24..31  policy (enum scull_access_policy)
+ *   bits 32..63  owner uid, meaningful while the count is not 0
+ */
+#define SA_COUNT(v) ((unsigned int)((v) & 0xffffff))
+#define SA_POLICY(v) ((unsigned int)(((v) >> 24) & 0xff))
+#define SA_OWNER(v) ((uid_t)((v) >> 32))
+#define SA_MAKE(policy, count, owner) (((u64)(owner) << 32) | ((u64)(policy) << 24) | (count))
+#define SA_MAX_COUNT 0xffffff
 
-static int scull_single_open(struct inode *inode, struct file *filp){
-    struct scull_dev *dev = &scull_single_dev;
-    if (!atomic_dec_and_test(&scull_single_flag))
-    {
-        // if after decrement its not zero, someone else had it open
-        atomic_inc(&scull_single_flag);
-        return -EBUSY;
+static const char * const scull_access_names[SCULL_ACCESS_NR] = {
+    "none", "single", "uid", "wuid", "priv", "proc", "open",
+};
+
+/*
+ * Private instances: the priv/proc/open policies give every tty/process/open a scull_dev of
+ * its own. Unless scull_priv_seed is off, an instance starts as a lazy clone of the device it
+ * was opened through, as that device was at the time: the parent is frozen into a read-only
+ * copy (scull_freeze), shared by every clone made until the parent next changes, and the
+ * instance reads its quanta from that copy (dev->template) until it writes them
+ * (copy-on-write in scull_write). Later writes or a reset of the parent are not seen.
+ *
+ * Keyed instances live in parent->priv_devs and outlive their last close: all of them are on
+ * one LRU list, and idle ones are reclaimed after scull_priv_idle seconds, or oldest first
+ * whenever their data together goes over scull_priv_max_mem.
+ */
+struct scull_priv {
+    struct scull_dev device; // what filp->private_data points at
+    struct scull_dev *parent;
+    unsigned long key; // index in parent->priv_devs
+    int kind; // SCULL_ACCESS_PRIV, _PROC or _OPEN
+    atomic_t users; // open files, -1 once reclaim owns it
+    unsigned long last_used; // jiffies at the last close
+    struct list_head lru; // on scull_priv_lru, least recently used first
+    struct rcu_head rcu; // openers look it up under RCU
+};
+
+unsigned long scull_priv_max_mem = 64 << 20;
+int scull_priv_idle = 60;
+bool scull_priv_seed = true;
+static atomic_long_t scull_priv_mem; // bytes held by all instances (their device.mem)
+static LIST_HEAD(scull_priv_lru);
+static DEFINE_SPINLOCK(scull_priv_lock); // protects scull_priv_lru
+static void scull_priv_gc(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scull_priv_gc_work, scull_priv_gc);
+
+static struct scull_priv *scull_priv_alloc(struct scull_dev *parent, int kind, unsigned long key)
+{
+    struct scull_priv *p = kzalloc(sizeof(*p), GFP_KERNEL);
+
+    if (!p)
+        return ERR_PTR(-ENOMEM);
+    scull_dev_reset(&p->device);
+    sema_init(&p->device.sem, 1);
+    p->device.mem_pool = &scull_priv_mem;
+    p->parent = parent;
+    p->key = key;
+    p->kind = kind;
+    atomic_set(&p->users, 1);
+    INIT_LIST_HEAD(&p->lru);
+    if (down_interruptible(&parent->sem)) {
+        kfree(p);
+        return ERR_PTR(-ERESTARTSYS);
     }
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-        scull_dev_reset(dev);
-    filp->private_data = dev;
-    return 0;
+    if (READ_ONCE(scull_priv_seed))
+    {
+        p->device.quantum = parent->quantum;
+        p->device.qset = parent->qset;
+        p->device.size = parent->size;
+        if (parent->data)
+        {
+            struct scull_dev *snap = scull_freeze(parent, &scull_priv_mem);
 
+            if (IS_ERR(snap)) {
+                up(&parent->sem);
+                kfree(p);
+                return ERR_CAST(snap);
+            }
+            p->device.template = snap;
+        }
+    }
+    up(&parent->sem);
+    return p;
 }
 
-static int scull_single_release(struct inode * inode, struct file * filp)
+static void scull_priv_free(struct scull_priv *p)
 {
-    atomic_inc(&scull_single_flag);
-    return 0;
+    scull_dev_reset(&p->device); // uncharges scull_priv_mem
+    kfree_rcu(p, rcu);
 }
 
-struct file_operations scull_single_fops ={
-    .owner = THIS_MODULE,
-    .unlocked_ioctl = scull_ioctl,
-    .llseek = scull_llseek,
-    .read=scull_read,
-    .write=scull_write,
-    .open = scull_single_open,
-    .release = scull_single_release,
-};
-
+/*
+ * Free idle instances (of parent, or of every device if NULL): the ones idle for at least
+ * idle jiffies (0: no age limit), and then the least recently used ones while
+ * scull_priv_mem is still >= target.
+ */
+static void scull_priv_reclaim(struct scull_dev *parent, unsigned long idle, long target)
+{
+    struct scull_priv *p, *tmp;
+    LIST_HEAD(victims);
+    long mem = atomic_long_read(&scull_priv_mem);
 
+    spin_lock(&scull_priv_lock);
+    list_for_each_entry_safe(p, tmp, &scull_priv_lru, lru)
+    {
+        if (parent && p->parent != parent)
+            continue;
+        if (mem < target && (!idle || time_before(jiffies, READ_ONCE(p->last_used) + idle)))
+        {
+            if (!idle)
+                break; // the rest are younger and we are under target
+            continue;
+        }
+        // only an instance nobody has open, and no opener can revive it after this
+        if (atomic_cmpxchg(&p->users, 0, -1) != 0)
+            continue;
+        // an opener may already have replaced the dead entry, then leave the new one alone
+        xa_cmpxchg(&p->parent->priv_devs, p->key, p, NULL, 0);
+        list_move(&p->lru, &victims);
+        mem -= p->device.mem;
+    }
+    spin_unlock(&scull_priv_lock);
+    list_for_each_entry_safe(p, tmp, &victims, lru)
+        scull_priv_free(p);
+}
 
-// sculluid - single user at a time - allows the same user to open multiple times, but if a diff user tries while one user has it open, that open will refuse
-struct scull_dev scull_uid_dev;
-static DEFINE_SPINLOCK(scull_uid_lock);
-uid_t scull_uid_owner;
-int scull_uid_count = 0;
+/*
+ * Age out idle instances once a second, but only while there are some to age: the work
+ * stops when the LRU is empty or aging is off, and scull_priv_put() starts it again.
+ */
+static void scull_priv_gc(struct work_struct *work)
+{
+    int idle = READ_ONCE(scull_priv_idle);
+    bool more;
 
+    if (idle <= 0)
+        return;
+    scull_priv_reclaim(NULL, idle * HZ, LONG_MAX);
+    spin_lock(&scull_priv_lock);
+    more = !list_empty(&scull_priv_lru);
+    spin_unlock(&scull_priv_lock);
+    if (more)
+        schedule_delayed_work(&scull_priv_gc_work, round_jiffies_relative(HZ));
+}
 
-static int scull_uid_open(struct inode *inode, struct file *filp)
+/* the private instance of parent for the caller, with one more user */
+static struct scull_dev *scull_priv_get(struct scull_dev *parent, int kind)
 {
-    struct scull_dev *dev = &scull_uid_dev;
-    spin_lock(&scull_uid_lock);
-    if (scull_uid_count &&
-        (scull_uid_owner != __kuid_val(current_uid())) &&
-        (scull_uid_owner != __kuid_val(current_euid())) &&
-        !capable(CAP_DAC_OVERRIDE)
-        )
+    struct scull_priv *p, *old;
+    unsigned long key;
+
+    if (kind == SCULL_ACCESS_OPEN)
     {
-        // device is busy with another user, and current process is not the owner nor root
-        spin_unlock(&scull_uid_lock);
-        return -EBUSY;
+        // per open: nobody else can ever find it, so it is not indexed or on the LRU
+        p = scull_priv_alloc(parent, kind, 0);
+        return IS_ERR(p) ? ERR_CAST(p) : &p->device;
     }
-    if (scull_uid_count == 0)
-        scull_uid_owner =  __kuid_val(current_uid());
-    scull_uid_count++;
-    spin_unlock(&scull_uid_lock);
-    //* then everything else is copied from bare scull */
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-        scull_dev_reset(dev);
-    filp->private_data = dev;
-    return 0;
+    if (kind == SCULL_ACCESS_PRIV)
+    {
+        if (!current->signal->tty)
+        {
+            pr_debug("Process %s has no ctl tty\n", current->comm);
+            return ERR_PTR(-EINVAL);
+        }
+        key = (unsigned long)tty_devnum(current->signal->tty) << 1;
+    }
+    else
+        key = (unsigned long)current->tgid << 1 | 1; // odd keys: a pid never collides with a tty
+    for (;;)
+    {
+        // fast path: the instance exists and is alive, RCU lookup without any lock
+        rcu_read_lock();
+        p = xa_load(&parent->priv_devs, key);
+        if (p && atomic_inc_unless_negative(&p->users))
+        {
+            rcu_read_unlock();
+            return &p->device;
+        }
+        // being reclaimed: take the entry out of the way now, p cannot be freed under us
+        if (p)
+            xa_cmpxchg(&parent->priv_devs, key, p, NULL, 0);
+        rcu_read_unlock();
 
+        p = scull_priv_alloc(parent, kind, key);
+        if (IS_ERR(p))
+            return ERR_CAST(p);
+        /*
+         * on the LRU before it is published: once in the xarray another opener can find it
+         * and close it, and scull_priv_put() moves it on the LRU. users is 1, so reclaim
+         * leaves it alone meanwhile.
+         */
+        WRITE_ONCE(p->last_used, jiffies);
+        spin_lock(&scull_priv_lock);
+        list_add_tail(&p->lru, &scull_priv_lru);
+        spin_unlock(&scull_priv_lock);
+        // two first openers with the same key may race: the loser frees its copy and looks again
+        old = xa_cmpxchg(&parent->priv_devs, key, NULL, p, GFP_KERNEL);
+        if (!old)
+            break;
+        spin_lock(&scull_priv_lock);
+        list_del(&p->lru);
+        spin_unlock(&scull_priv_lock);
+        scull_priv_free(p);
+        if (xa_is_err(old))
+            return ERR_PTR(xa_err(old));
+    }
+    return &p->device;
 }
 
-static int scull_uid_release(struct inode *inode, struct file *filp)
+static void scull_priv_put(struct scull_priv *p)
 {
-    spin_lock(&scull_uid_lock);
-    scull_uid_count--;
-    spin_unlock(&scull_uid_lock);
-    return 0;
+    if (p->kind == SCULL_ACCESS_OPEN)
+    {
+        scull_priv_free(p);
+        return;
+    }
+    WRITE_ONCE(p->last_used, jiffies);
+    // most recently used goes last; moved before the drop so reclaim never sees it half done
+    spin_lock(&scull_priv_lock);
+    list_move_tail(&p->lru, &scull_priv_lru);
+    spin_unlock(&scull_priv_lock);
+    atomic_dec(&p->users);
+    // something can age out now: make sure the gc runs (no-op while it is already pending)
+    if (READ_ONCE(scull_priv_idle) > 0)
+        schedule_delayed_work(&scull_priv_gc_work, round_jiffies_relative(HZ));
 }
-struct file_operations scull_uid_fops ={
-    .owner = THIS_MODULE,
-    .unlocked_ioctl = scull_ioctl,
-    .llseek = scull_llseek,
-    .read=scull_read,
-    .write=scull_write,
-    .open = scull_uid_open,
-    .release = scull_uid_release,
-};
 
-/* scullwuid - similar to sculluid but instead of refusing a second user,
- * it will wait until the device is free (blocking open)
+/*
+ * Count this open against dev->access, or refuse it:
+ *   single - one open at a time, any 2nd open returns -EBUSY
+ *   uid    - the same user may open many times, another user gets -EBUSY while it is open
+ *   wuid   - like uid, but another user waits (blocking open) until the device is free
+ *   priv   - anyone, each controlling tty gets its own data (see scull_priv_get)
+ *   proc   - anyone, each process gets its own data
+ *   open   - anyone, each open gets its own data, dropped at close
  */
-uid_t scull_wuid_owner = (uid_t)-1;
-static DEFINE_SPINLOCK(scull_wuid_lock);
-static DECLARE_WAIT_QUEUE_HEAD(scull_wuid_wait);
-struct scull_dev scull_wuid_dev;
+static int scull_access_get(struct scull_dev *dev, struct file *filp)
+{
+    uid_t uid = __kuid_val(current_uid()), euid = __kuid_val(current_euid());
+    s64 old = atomic64_read(&dev->access);
+    unsigned int count, policy;
+    uid_t owner;
+    int override = -1; // capable() audits, so only ask when it matters, and once
 
-int scull_wuid_count = 0;
-static int scull_wuid_available(void)
+    for (;;)
+    {
+        count = SA_COUNT(old);
+        policy = SA_POLICY(old);
+        owner = SA_OWNER(old);
+        if (count == SA_MAX_COUNT)
+            return -EMFILE;
+        if (policy == SCULL_ACCESS_SINGLE && count)
+            return -EBUSY;
+        if ((policy == SCULL_ACCESS_UID || policy == SCULL_ACCESS_WUID) &&
+            count && owner != uid && owner != euid)
+        {
+            if (override < 0)
+                override = capable(CAP_DAC_OVERRIDE);
+            if (!override)
+            {
+                // device is busy with another user, and current process is not the owner nor root
+                if (policy == SCULL_ACCESS_UID)
+                    return -EBUSY;
+                if (filp->f_flags & O_NONBLOCK)
+                    return -EAGAIN;
+                if (wait_event_interruptible(dev->access_wait, SA_COUNT(atomic64_read(&dev->access)) == 0 ||
+                                             SA_POLICY(atomic64_read(&dev->access)) != policy))
+                    return -ERESTARTSYS;
+                old = atomic64_read(&dev->access);
+                continue;
+            }
+        }
+        if (atomic64_try_cmpxchg(&dev->access, &old, SA_MAKE(policy, count + 1, count ? owner : uid)))
+            return policy;
+        // lost a race with another open/release: old was reloaded, look again
+    }
+}
+
+static void scull_access_put(struct scull_dev *dev)
 {
-    return scull_wuid_count == 0 ||
-        scull_wuid_owner == __kuid_val(current->cred->uid) ||
-        scull_wuid_owner ==__kuid_val(current->cred->euid) ||
-            capable(CAP_DAC_OVERRIDE);
+    // the count is the low bits and at least 1, so a plain subtract cannot touch the rest
+    if (SA_COUNT(atomic64_dec_return(&dev->access)) == 0)
+        wake_up_interruptible_sync(&dev->access_wait);
 }
-static int scull_wuid_open(struct inode *inode, struct file *filp)
+
+static int scull_access_release(struct inode *inode, struct file *filp)
 {
-    pr_warn("wuid_open: pid=%d euid=%u f=%#x mode=%ul openers=%d owner=%d\n",
-        current->pid, __kuid_val(current_euid()),
-        filp->f_flags, filp->f_mode, scull_wuid_count, scull_wuid_owner);
+    struct scull_dev *dev = container_of(inode->i_cdev, struct scull_dev, cdev);
 
-    struct scull_dev *dev = &scull_wuid_dev;
-    spin_lock(&scull_wuid_lock);
-    while (!scull_wuid_available()){
-        spin_unlock(&scull_wuid_lock);
-        if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
+    // private_data may be a private instance: the count lives in the device that was opened
+    if (filp->private_data != dev)
+        scull_priv_put(container_of(filp->private_data, struct scull_priv, device));
+    scull_access_put(dev);
+    return 0;
+}
 
-        if (wait_event_interruptible(scull_wuid_wait, scull_wuid_available()))
-            return -ERESTARTSYS;
-        spin_lock(&scull_wuid_lock);
+static int scull_access_open(struct inode *inode, struct file *filp)
+{
+    struct scull_dev *dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+    int policy = scull_access_get(dev, filp);
+
+    if (policy < 0)
+        return policy;
+    if (policy >= SCULL_ACCESS_PRIV)
+    {
+        dev = scull_priv_get(dev, policy);
+        if (IS_ERR(dev)) {
+            scull_access_put(container_of(inode->i_cdev, struct scull_dev, cdev));
+            return PTR_ERR(dev);
+        }
     }
-    if (scull_wuid_count == 0)
-        scull_wuid_owner =  __kuid_val(current_uid());
-    scull_wuid_count++;
-    spin_unlock(&scull_wuid_lock);
     /* then, everything else is copied from the bare scull device */
+    filp->private_data = dev;
     if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
+    {
+        if (down_interruptible(&dev->sem)) {
+            scull_access_release(inode, filp);
+            return -ERESTARTSYS;
+        }
         scull_dev_reset(dev);
-    filp->private_data = dev;
+        up(&dev->sem);
+    }
     return 0;
-
 }
 
-static int scull_wuid_release(struct inode *inode, struct file *filp)
+/* switch the policy of the minor behind filp; the caller's must be the only open */
+static long scull_access_set(struct file *filp, unsigned long policy)
 {
-    int temp;
-    spin_lock(&scull_wuid_lock);
-    scull_wuid_count--;
-    temp = scull_wuid_count;
-    spin_unlock(&scull_wuid_lock);
-    if (temp == 0)
-        wake_up_interruptible_sync(&scull_wuid_wait);
+    struct scull_dev *dev = container_of(file_inode(filp)->i_cdev, struct scull_dev, cdev);
+    s64 old = atomic64_read(&dev->access);
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (policy >= SCULL_ACCESS_NR)
+        return -EINVAL;
+    do {
+        if (SA_COUNT(old) != 1)
+            return -EBUSY;
+    } while (!atomic64_try_cmpxchg(&dev->access, &old, SA_MAKE(policy, 1, SA_OWNER(old))));
+    // a wuid opener may be waiting on a rule that no longer applies
+    wake_up_interruptible(&dev->access_wait);
+    pr_debug("scull %d:%d: access policy %s\n", MAJOR(dev->cdev.dev), MINOR(dev->cdev.dev),
+             scull_access_names[policy]);
     return 0;
 }
-struct file_operations scull_wuid_fops ={
-    .owner = THIS_MODULE,
-    .unlocked_ioctl = scull_ioctl,
-    .llseek = scull_llseek,
-    .read=scull_read,
-    .write=scull_write,
-    .open = scull_wuid_open,
-    .release = scull_wuid_release,
-};
 
-/* scullpriv: device that clones itself on open
- * Giving each opener a separate data area (keyed by something like a process id or controlling tty
- */
-static LIST_HEAD(scull_priv_list);
-static DEFINE_SPINLOCK(scull_priv_lock);
-
-/* Shared structure if key matches */
-struct scull_listitem{
-    struct scull_dev device;
-    dev_t key;
-    struct list_head list;
-};
-static struct scull_dev *scull_find_listitem(dev_t key)
+/* private instances share scull_priv_max_mem: make room, or refuse to grow any more */
+static int scull_priv_room(struct scull_dev *dev)
 {
-    struct scull_listitem *item;
-    list_for_each_entry(item, &scull_priv_list, list)
+    long max = READ_ONCE(scull_priv_max_mem);
+
+    if (dev->mem_pool && max > 0 && atomic_long_read(dev->mem_pool) >= max)
     {
-        if (item->key == key)
-            return &(item->device);
+        scull_priv_reclaim(NULL, 0, max);
+        if (atomic_long_read(dev->mem_pool) >= max)
+            return -ENOSPC;
     }
-    // Here we can just create the missing key scull_dev
-    item = kmalloc(sizeof(struct scull_listitem), GFP_KERNEL);
-    if (!item) return NULL;
-    memset(item, 0, sizeof(struct scull_listitem));
-    item->key = key;
-    scull_dev_reset(&item->device);
-    sema_init(&item->device.sem, 1);
-
+    return 0;
+}
 
-    list_add(&(item->list), &scull_priv_list);
+static ssize_t scull_access_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    int err = scull_priv_room(filp->private_data);
 
-    return &item->device;
+    return err ? err : scull_write(filp, buf, count, f_pos);
 }
-static int scull_priv_open(struct inode *inode, struct file *filp)
+
+static long scull_access_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    struct scull_dev *dev;
-    dev_t key;
-    if (!current->signal->tty)
+    switch (cmd)
     {
-        pr_debug("Process %s has no ctl tty\n", current->comm);
-        return -EINVAL;
+    /* "Tell" policy via arg value */
+    case SCULL_IOCTACCESS:
+        return scull_access_set(filp, arg);
+    /* "Query" policy via return value */
+    case SCULL_IOCQACCESS:
+        return SA_POLICY(atomic64_read(&container_of(file_inode(filp)->i_cdev, struct scull_dev, cdev)->access));
+    /* batched writes grow a private instance just like write(), so each one is checked */
+    case SCULL_IOCBATCH:
+        return scull_do_batch(filp, filp->private_data, (struct scull_batch __user *)arg, scull_priv_room);
+    default:
+        return scull_ioctl(filp, cmd, arg);
     }
-    key = tty_devnum(current->signal->tty);
-    spin_lock(&scull_priv_lock);
-    dev = scull_find_listitem(key);
-    spin_unlock(&scull_priv_lock);
-
-    if (!dev) return -ENOMEM;
-    /* then, everything else is copied from the bare scull device */
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-        scull_dev_reset(dev);
-    filp->private_data = dev;
-    return 0;
 }
 
-static int scull_priv_release(struct inode *inode, struct file *filp)
-{
-    return 0;
-}
-struct file_operations scull_priv_fops ={
+const struct file_operations scull_access_fops ={
     .owner = THIS_MODULE,
-    .unlocked_ioctl = scull_ioctl,
+    .unlocked_ioctl = scull_access_ioctl,
     .llseek = scull_llseek,
     .read=scull_read,
-    .write=scull_write,
-    .open = scull_priv_open,
-    .release = scull_priv_release,
+    .write=scull_access_write,
+    .open = scull_access_open,
+    .release = scull_access_release,
 };
-/* A placeholder scull_dev which really just holds the cdev stuff. */
-static struct scull_dev scull_priv_dev;
+
+void scull_access_dev_init(struct scull_dev *dev, int policy)
+{
+    atomic64_set(&dev->access, SA_MAKE(policy, 0, 0));
+    init_waitqueue_head(&dev->access_wait);
+    xa_init(&dev->priv_devs);
+}
+
+/* free the private instances of a device that nobody can open any more */
+void scull_access_dev_cleanup(struct scull_dev *dev)
+{
+    scull_priv_reclaim(dev, 0, LONG_MIN);
+    xa_destroy(&dev->priv_devs);
+}
+
+/* The classic fixed devices: plain scull devices with a policy attached from the start */
+static struct scull_dev scull_single_dev, scull_uid_dev, scull_wuid_dev, scull_priv_dev;
 
 static dev_t devno;
 static struct scull_adev_info
 {
     char *name;
     struct scull_dev *sculldev;
-    struct file_operations *fops;
+    int policy;
 }scull_access_devs[] = {
-    {"scullsingle", &scull_single_dev, &scull_single_fops},
-    {"sculluid", &scull_uid_dev, &scull_uid_fops},
-    {"scullwuid", &scull_wuid_dev, &scull_wuid_fops},
-    {"scullpriv", &scull_priv_dev, &scull_priv_fops}
+    {"scullsingle", &scull_single_dev, SCULL_ACCESS_SINGLE},
+    {"sculluid", &scull_uid_dev, SCULL_ACCESS_UID},
+    {"scullwuid", &scull_wuid_dev, SCULL_ACCESS_WUID},
+    {"scullpriv", &scull_priv_dev, SCULL_ACCESS_PRIV}
 };
 static struct class *cls;
 static void scull_access_setup(dev_t devnum, struct scull_adev_info *devinfo)
@@ -254,8 +457,9 @@ static void scull_access_setup(dev_t devnum, struct scull_adev_info *devinfo)
     dev->quantum = scull_quantum;
     dev->qset = scull_qset;
     sema_init(&dev->sem, 1);
+    scull_access_dev_init(dev, devinfo->policy);
     /* do the cdev stuff */
-    cdev_init(&dev->cdev, devinfo->fops);
+    cdev_init(&dev->cdev, &scull_access_fops);
     err = cdev_add(&dev->cdev, devnum, 1);
     if (err)
     {
@@ -287,24 +491,18 @@ int scull_access_init(dev_t firstdev)
 
 void scull_access_cleanup()
 {
-   struct scull_listitem *lptr, *next;
     int i;
+    cancel_delayed_work_sync(&scull_priv_gc_work);
     /* clean up the static devs */
     for (i=0; i < ARRAY_SIZE(scull_access_devs); i++)
     {
         struct scull_dev *dev = scull_access_devs[i].sculldev;
         cdev_del(&dev->cdev);
         scull_dev_reset(dev);
+        /* And all the cloned devices */
+        scull_access_dev_cleanup(dev);
         device_destroy(cls, MKDEV(MAJOR(devno), MINOR(devno)+i));
     }
-    list_for_each_entry_safe(lptr, next, &scull_priv_list, list)
-    {
-        list_del(&lptr->list);
-        scull_dev_reset(&lptr->device);
-        kfree(lptr);
-
-    }
-    /* And all the cloneed device */
     unregister_chrdev_region(devno, ARRAY_SIZE(scull_access_devs));
     class_destroy(cls);
 }
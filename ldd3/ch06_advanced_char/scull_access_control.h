@@ -1,5 +1,15 @@
 #ifndef _SCULL_ACCESS_CONTROL_H_
 #define _SCULL_ACCESS_CONTROL_H_
+#include <linux/fs.h>
+struct scull_dev;
+/* open/release/ioctl that enforce dev->access on any scull_dev (SCULL_IOCTACCESS) */
+extern const struct file_operations scull_access_fops;
+void scull_access_dev_init(struct scull_dev *dev, int policy);
+void scull_access_dev_cleanup(struct scull_dev *dev);
 int scull_access_init(dev_t);
 void scull_access_cleanup(void);
+
+extern unsigned long scull_priv_max_mem;
+extern int scull_priv_idle;
+extern bool scull_priv_seed;
 #endif
@@ -1,141 +1,1126 @@
 #include <linux/fcntl.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/container_of.h>
 #include <linux/poll.h>
+#include <linux/log2.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/sched/clock.h>
+#include <linux/timekeeping.h>
 #include "scull.h"
 #include "scull_pipe.h"
+#include "scull_pipe_ioctl.h"
+#define CREATE_TRACE_POINTS
+#include "scull_pipe_trace.h"
 
 #include <linux/debugfs.h>
 struct dentry *debugfs_pipe_root;
 
-int scull_p_buffer = 100;
+int scull_p_buffer = 16 * PAGE_SIZE; /* default ring size per pipe */
+int scull_p_max_buffer = 16 * 1024 * 1024; /* largest ring a user without CAP_SYS_RESOURCE may ask for */
+int scull_p_max_busy_poll = 200; /* cap on SCULL_P_IOCTBUSYPOLL, in microseconds */
+#define SCULL_P_HARD_MAX_BUFFER (256U * 1024 * 1024)
 int scull_p_nr_devs = 4;
 struct scull_pipe *scull_p_devices;
 static struct class *pipe_cls;
 dev_t scull_p_devno;
 
-static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/* round a requested size up to what the ring can use: a power-of-two number of pages */
+static unsigned int scull_p_round_size(unsigned long size)
 {
-    struct scull_pipe *dev = filp->private_data;
-    // sleep if someone has the lock
-    if (down_interruptible(&dev->sem))
+    if (size < PAGE_SIZE)
+        size = PAGE_SIZE;
+    return roundup_pow_of_two(size);
+}
+
+static void scull_p_buf_free(struct scull_p_buf *b)
+{
+    unsigned int i;
+    vunmap(b->data);
+    for (i = 0; i < b->nr_pages; i++)
+        __free_page(b->pages[i]);
+    kvfree(b->pages);
+    kfree(b);
+}
+static void scull_p_buf_release(struct kref *ref)
+{
+    scull_p_buf_free(container_of(ref, struct scull_p_buf, ref));
+}
+static void scull_p_buf_put(struct scull_p_buf *b)
+{
+    if (b)
+        kref_put(&b->ref, scull_p_buf_release);
+}
+
+/*
+ * Keyed wakeups: the key tells epoll what changed, so an entry that only asked for
+ * EPOLLIN is not run (or woken) for room showing up, and the other way round.
+ */
+static inline void scull_p_wake_readers(struct scull_pipe *dev, __poll_t key)
+{
+    trace_scull_p_wake(dev, false, EPOLLIN | EPOLLRDNORM | key);
+    wake_up_interruptible_poll(&dev->inq, EPOLLIN | EPOLLRDNORM | key);
+}
+static inline void scull_p_wake_writers(struct scull_pipe *dev)
+{
+    trace_scull_p_wake(dev, true, EPOLLOUT | EPOLLWRNORM);
+    wake_up_interruptible_poll(&dev->outq, EPOLLOUT | EPOLLWRNORM);
+}
+
+static struct scull_p_buf *scull_p_buf_alloc(struct scull_pipe *dev, unsigned int size)
+{
+    struct scull_p_buf *b;
+    unsigned int i;
+
+    b = kzalloc(sizeof(*b), GFP_KERNEL);
+    if (!b)
+        return NULL;
+    kref_init(&b->ref);
+    spin_lock_init(&b->pin_lock);
+    INIT_LIST_HEAD(&b->pins);
+    b->dev = dev;
+    b->size = size;
+    b->pages = kvcalloc(size >> PAGE_SHIFT, sizeof(*b->pages), GFP_KERNEL);
+    if (!b->pages)
+        goto fail;
+    for (i = 0; i < size >> PAGE_SHIFT; i++, b->nr_pages++)
+    {
+        b->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!b->pages[i])
+            goto fail;
+    }
+    /* one contiguous kernel view so the copy paths stay plain memcpy/copy_*_user */
+    b->data = vmap(b->pages, b->nr_pages, VM_MAP, PAGE_KERNEL);
+    if (!b->data)
+        goto fail;
+    return b;
+
+fail:
+    scull_p_buf_free(b);
+    return NULL;
+}
+
+/* a multi-queue writer's own ring, the same size as the pipe's */
+static struct scull_p_sub *scull_p_sub_alloc(struct scull_pipe *dev)
+{
+    struct scull_p_sub *sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+
+    if (!sub)
+        return NULL;
+    sub->ring.buf = scull_p_buf_alloc(dev, dev->ring.size);
+    if (!sub->ring.buf) {
+        kfree(sub);
+        return NULL;
+    }
+    sub->ring.size = dev->ring.size;
+    mutex_init(&sub->wlock);
+    return sub;
+}
+static void scull_p_sub_free(struct scull_p_sub *sub)
+{
+    scull_p_buf_put(sub->ring.buf);
+    kfree(sub);
+}
+
+static inline struct scull_pipe *scull_p_dev(struct file *filp)
+{
+    return ((struct scull_p_file *)filp->private_data)->dev;
+}
+
+/*
+ * A pin covers the bytes one splice_read call lent to a pipe, starting at ring index start.
+ * It stays on buf->pins until every pipe_buffer built from it is released, and until then
+ * writers stop at start + size so they never overwrite pages a pipe still points at.
+ */
+struct scull_p_pin {
+    struct list_head node;
+    struct scull_p_buf *buf;
+    /*
+     * the spliced file: the pipe_buffer ops live in this module, and a file reference keeps
+     * it loaded. The last fput() hands the module_put() to __fput(), outside our text, so
+     * the module never drops its last reference from code of its own.
+     */
+    struct file *file;
+    unsigned int start; // ring index of the first lent byte
+    atomic_t refs; // pipe_buffers (and tee copies) still referencing the range
+};
+
+static void scull_p_pin_put(struct scull_p_pin *pin)
+{
+    struct scull_p_buf *b = pin->buf;
+    struct scull_pipe *dev = b->dev;
+    struct file *file = pin->file;
+
+    if (!atomic_dec_and_test(&pin->refs))
+        return;
+    spin_lock(&b->pin_lock);
+    list_del(&pin->node);
+    spin_unlock(&b->pin_lock);
+    kfree(pin);
+    /* the oldest pin may have moved: let blocked writers recompute their room */
+    atomic_inc(&dev->room_seq);
+    scull_p_wake_writers(dev);
+    scull_p_buf_put(b);
+    fput(file); // last thing: may let the module go once we have returned
+}
+
+static void scull_p_pipe_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *pbuf)
+{
+    put_page(pbuf->page);
+    scull_p_pin_put((struct scull_p_pin *)pbuf->private);
+}
+/* tee() duplicates the pipe_buffer: the copy shares the pin */
+static bool scull_p_pipe_buf_get(struct pipe_inode_info *pipe, struct pipe_buffer *pbuf)
+{
+    struct scull_p_pin *pin = (struct scull_p_pin *)pbuf->private;
+
+    if (!generic_pipe_buf_get(pipe, pbuf))
+        return false;
+    atomic_inc(&pin->refs);
+    return true;
+}
+/* no .try_steal: the page stays part of our ring, a pipe can only borrow it */
+static const struct pipe_buf_operations scull_p_pipe_buf_ops = {
+    .release = scull_p_pipe_buf_release,
+    .get = scull_p_pipe_buf_get,
+};
+
+/* bytes queued: head is owned by writers, tail by readers */
+static inline unsigned int scull_p_used(const struct scull_p_ring *r)
+{
+    return READ_ONCE(r->head) - READ_ONCE(r->tail);
+}
+static inline unsigned int scull_p_space(const struct scull_p_ring *r)
+{
+    return r->size - scull_p_used(r);
+}
+/*
+ * bytes the read side can count on: the ring, or the sum over the sub-rings.
+ * Writers add to mq_queued after publishing head, so it can lag but never lead.
+ */
+static inline unsigned long scull_p_queued(struct scull_pipe *dev)
+{
+    if (READ_ONCE(dev->multiq))
+        return max(atomic_long_read(&dev->mq_queued), 0L);
+    return scull_p_used(&dev->ring);
+}
+
+/* effective wake thresholds: at least 1, at most the ring */
+static inline unsigned int scull_p_rlowat(const struct scull_pipe *dev)
+{
+    return clamp(READ_ONCE(dev->rcvlowat), 1U, READ_ONCE(dev->ring.size));
+}
+static inline unsigned int scull_p_wlowat(const struct scull_pipe *dev)
+{
+    return clamp(READ_ONCE(dev->sndlowat), 1U, READ_ONCE(dev->ring.size));
+}
+
+/*
+ * Bytes a writer may fill at head: the free space, cut short so it never reaches
+ * the oldest range still lent to a pipe by splice_read. Called with wlock held.
+ */
+static unsigned int scull_p_writable(const struct scull_p_ring *r)
+{
+    struct scull_p_buf *b = r->buf;
+    unsigned int head = r->head;
+    unsigned int room = r->size - (head - smp_load_acquire(&r->tail));
+    struct scull_p_pin *oldest;
+
+    spin_lock(&b->pin_lock);
+    oldest = list_first_entry_or_null(&b->pins, struct scull_p_pin, node);
+    if (oldest)
+        room = min(room, oldest->start + r->size - head);
+    spin_unlock(&b->pin_lock);
+    return room;
+}
+
+/* copy n bytes starting at ring index pos out to the user, both wrap segments in one call */
+static int scull_p_copy_out(struct scull_p_ring *r, unsigned int pos, char __user *buf, unsigned int n)
+{
+    char *data = r->buf->data;
+    unsigned int off = pos & (r->size - 1);
+    unsigned int first = min(n, r->size - off);
+
+    if (copy_to_user(buf, data + off, first))
+        return -EFAULT;
+    if (n > first && copy_to_user(buf + first, data, n - first))
+        return -EFAULT;
+    return 0;
+}
+/* copy n bytes from the user into the ring starting at index pos, wrapping if needed */
+static int scull_p_copy_in(struct scull_p_ring *r, unsigned int pos, const char __user *buf, unsigned int n)
+{
+    char *data = r->buf->data;
+    unsigned int off = pos & (r->size - 1);
+    unsigned int first = min(n, r->size - off);
+
+    if (copy_from_user(data + off, buf, first))
+        return -EFAULT;
+    if (n > first && copy_from_user(data, buf + first, n - first))
+        return -EFAULT;
+    return 0;
+}
+
+/* same as scull_p_copy_out, into a kernel buffer (record headers) */
+static void scull_p_copy_out_kernel(struct scull_p_ring *r, unsigned int pos, void *dst, unsigned int n)
+{
+    char *data = r->buf->data;
+    unsigned int off = pos & (r->size - 1);
+    unsigned int first = min(n, r->size - off);
+
+    memcpy(dst, data + off, first);
+    if (n > first)
+        memcpy((char *)dst + first, data, n - first);
+}
+/* same as scull_p_copy_in, from a kernel buffer (splice_write, record headers) */
+static void scull_p_copy_in_kernel(struct scull_p_ring *r, unsigned int pos, const char *src, unsigned int n)
+{
+    char *data = r->buf->data;
+    unsigned int off = pos & (r->size - 1);
+    unsigned int first = min(n, r->size - off);
+
+    memcpy(data + off, src, first);
+    if (n > first)
+        memcpy(data, src + first, n - first);
+}
+
+/*
+ * Busy-poll, like SO_BUSY_POLL: spin for up to the pipe's budget waiting for need bytes
+ * (or the last writer to go). Gives up early if the CPU is wanted or a signal is pending.
+ * Returns true if the condition came true, false if the caller should sleep.
+ */
+static bool scull_p_busy_wait(struct scull_pipe *dev, unsigned int need)
+{
+    unsigned int us = READ_ONCE(dev->busy_poll_us);
+    u64 end;
+
+    if (!us)
+        return false;
+    end = local_clock() + (u64)us * NSEC_PER_USEC;
+    do {
+        if (scull_p_queued(dev) >= need || !READ_ONCE(dev->nwriters))
+            return true;
+        cpu_relax();
+    } while (!need_resched() && !signal_pending(current) && local_clock() < end);
+    return false;
+}
+
+/*
+ * Wait until there is something to read: the receive low watermark when blocking, but
+ * never more than the caller asked for (want), as with SO_RCVLOWAT; any byte when
+ * non-blocking or once the writers are gone.
+ * Returns 1 with rlock held, 0 on EOF (empty and no writers), or a negative error.
+ */
+static int scull_p_wait_data(struct scull_pipe *dev, bool nonblock, size_t want)
+{
+    unsigned int need = nonblock ? 1 : max_t(size_t, 1, min_t(size_t, scull_p_rlowat(dev), want));
+    /* rlock only excludes other readers; writers never take it */
+    if (mutex_lock_interruptible(&dev->rlock))
         return -ERESTARTSYS;
-    while (dev->rp == dev->wp) // while empty
+    while (scull_p_queued(dev) < need) // while below the watermark
     {
-        if (dev->nwriters == 0) {     // no writers and nothing to read → EOF
-            up(&dev->sem);
-            return 0;
+        mutex_unlock(&dev->rlock);
+        if (READ_ONCE(dev->nwriters) == 0)  // no more data is coming
+        {
+            if (scull_p_queued(dev) == 0) // no writers and nothing to read → EOF
+                return 0;
+            need = 1; // hand out the short tail
         }
-        /* buffer is empty */
-        up(&dev->sem);
+        else
+        {
+            if (nonblock) //Nonblocking mode: no data, return immediately
+                return -EAGAIN; // temporary failure, try again later
 
-        if (filp->f_flags & O_NONBLOCK) //Nonblocking mode: no data, return immediately
-            return -EAGAIN; // temporary failure, try again later
+            // spin a little first if asked: data arriving soon beats a sleep/wake round trip
+            if (!scull_p_busy_wait(dev, need))
+            {
+                DEFINE_WAIT(wait);
+                trace_scull_p_sleep(dev, false, need);
+                // wait until enough is queued (or the last writer went away)
+                for (;;)
+                {
+                    unsigned int want_now;
 
-        pr_info("%s reading: going to sleep\n", current->comm);
-        // wait until not empty
-        if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
-            return -ERESTARTSYS;
+                    prepare_to_wait(&dev->inq, &wait, TASK_INTERRUPTIBLE);
+                    /*
+                     * below the watermark: tell writers the smallest amount worth a wakeup,
+                     * again on every pass, since a wakeup for another reader clears it
+                     */
+                    want_now = READ_ONCE(dev->rwant);
+                    while (need < want_now && !try_cmpxchg(&dev->rwant, &want_now, need))
+                        ;
+                    smp_mb(); // rwant before the queue check; pairs with scull_p_wrote()
+                    if (scull_p_queued(dev) >= need || !READ_ONCE(dev->nwriters))
+                        break;
+                    if (signal_pending(current))
+                    {
+                        finish_wait(&dev->inq, &wait);
+                        return -ERESTARTSYS;
+                    }
+                    schedule();
+                }
+                finish_wait(&dev->inq, &wait);
+            }
+        }
         // require lock after waking up
-        if (down_interruptible(&dev->sem))
+        if (mutex_lock_interruptible(&dev->rlock))
             return -ERESTARTSYS;
         // loop back and recheck condition
     }
-    // Now we have data available
-    /* count: will not be past dev->end */
-    if (dev->wp > dev->rp)
-        count = min(count, (size_t)(dev->wp - dev ->rp));
-    else // write pointer wrapped around, read until end of buffer
-        count = min(count, (size_t)(dev->end - dev->rp));
+    return 1;
+}
+
+#define SCULL_P_REC_HDR ((unsigned int)sizeof(struct scull_p_rec_hdr))
+/*
+ * Payload length of the record at tail, or -EIO if the header does not describe
+ * a record that fits in what is queued. Writers only publish whole records, so
+ * used > 0 means at least one is there.
+ */
+static long scull_p_rec_len(struct scull_p_ring *r, unsigned int head, unsigned int tail)
+{
+    struct scull_p_rec_hdr hdr;
+    unsigned int used = head - tail;
+
+    if (used < SCULL_P_REC_HDR)
+        return -EIO;
+    scull_p_copy_out_kernel(r, tail, &hdr, SCULL_P_REC_HDR);
+    if (hdr.len > used - SCULL_P_REC_HDR)
+        return -EIO;
+    return hdr.len;
+}
+
+/*
+ * After head moved by n: wake readers only once the receive watermark (or the smaller
+ * amount a sleeping reader asked for) is reached and somebody is actually waiting, and
+ * raise SIGIO only when this write crossed the watermark, so a chatty producer does not
+ * cost a context switch per message.
+ */
+static void scull_p_wrote(struct scull_pipe *dev, unsigned int n)
+{
+    unsigned int lowat = scull_p_rlowat(dev);
+    unsigned long used = scull_p_queued(dev);
+
+    /* wq_has_sleeper() has the full barrier between publishing head and reading rwant that
+     * pairs with the sleeper's smp_mb() between storing rwant and reading the queue: either
+     * the reader sees the new bytes or we see its rwant */
+    if (wq_has_sleeper(&dev->inq) && used >= min(lowat, READ_ONCE(dev->rwant)))
+    {
+        WRITE_ONCE(dev->rwant, UINT_MAX); // every sleeper wakes and stores its need again
+        scull_p_wake_readers(dev, 0);
+    }
+    /* signal asynchronous readers, if any */
+    if (dev->fasync_queue && used >= lowat && used < lowat + n)
+        kill_fasync(&dev->fasync_queue, SIGIO, POLL_IN);
+}
+/*
+ * After tail of r moved: wake writers once the send watermark worth of room is free.
+ * In multi-queue mode the sleepers may be waiting on other sub-rings; they recheck their own.
+ */
+static void scull_p_did_read(struct scull_pipe *dev, struct scull_p_ring *r)
+{
+    if (scull_p_space(r) >= scull_p_wlowat(dev) && wq_has_sleeper(&dev->outq))
+        scull_p_wake_writers(dev);
+}
+
+/*
+ * Writer side, wlock held: remember when the write ending at head went in.
+ * If the reader is SCULL_P_NR_MARKS writes behind, the write is just not sampled.
+ */
+static void scull_p_stamp(struct scull_pipe *dev, struct scull_p_ring *r, unsigned int head)
+{
+    unsigned int mhead = r->mhead;
+    struct scull_p_mark *mk;
 
-    /* copy to the user */
-    if (copy_to_user(buf, dev->rp, count)){
-        up(&dev->sem);
+    if (!READ_ONCE(dev->timestamp))
+        return;
+    if (mhead - smp_load_acquire(&r->mtail) == SCULL_P_NR_MARKS) {
+        atomic_long_inc(&dev->lat_missed);
+        return;
+    }
+    mk = &r->marks[mhead & (SCULL_P_NR_MARKS - 1)];
+    mk->pos = head;
+    mk->ts = ktime_get_ns();
+    smp_store_release(&r->mhead, mhead + 1);
+}
+/* Reader side, rlock held: each stamped write now read to its last byte is one sample */
+static void scull_p_unstamp(struct scull_pipe *dev, struct scull_p_ring *r, unsigned int tail)
+{
+    unsigned int mtail = r->mtail, mhead = smp_load_acquire(&r->mhead);
+    struct scull_p_mark *mk;
+    u64 now = 0;
+
+    for (; mtail != mhead; mtail++)
+    {
+        mk = &r->marks[mtail & (SCULL_P_NR_MARKS - 1)];
+        if ((int)(tail - mk->pos) < 0)
+            break;
+        if (!now)
+            now = ktime_get_ns();
+        dev->lat_hist[min_t(unsigned int, fls64(now - mk->ts), SCULL_P_LAT_BUCKETS - 1)]++;
+    }
+    smp_store_release(&r->mtail, mtail);
+}
+
+/* writer side: publish a new head once the data is in, and count it for the reader */
+static void scull_p_publish(struct scull_pipe *dev, struct scull_p_ring *r, unsigned int head)
+{
+    unsigned int n = head - r->head;
+
+    scull_p_stamp(dev, r, head);
+    /* release: the data is in the ring before readers can see the new head */
+    smp_store_release(&r->head, head);
+    if (r != &dev->ring)
+        atomic_long_add(n, &dev->mq_queued);
+    else if (dev->mctl)
+        smp_store_release(&dev->mctl->head, head); // for consumers of the mapping
+}
+/* reader side: publish a new tail once the copies are done, rlock held */
+static void scull_p_consume(struct scull_pipe *dev, struct scull_p_ring *r, unsigned int tail)
+{
+    unsigned int n = tail - r->tail;
+
+    /* release: our loads from the ring are done before the writer may reuse the space */
+    smp_store_release(&r->tail, tail);
+    if (r != &dev->ring)
+        atomic_long_sub(n, &dev->mq_queued);
+    else if (dev->mctl)
+        WRITE_ONCE(dev->mctl->tail, tail);
+    if (r->mtail != READ_ONCE(r->mhead))
+        scull_p_unstamp(dev, r, tail);
+    scull_p_did_read(dev, r);
+}
+
+/*
+ * Next ring to read from, rlock held, or NULL if everything is empty.
+ * In multi-queue mode this is the first sub-ring with data; it goes to the back of
+ * the list so every writer gets served in turn however fast the others produce.
+ * Sub-rings whose writer has closed are freed here once drained.
+ */
+static struct scull_p_ring *scull_p_next_ring(struct scull_pipe *dev)
+{
+    struct scull_p_sub *sub, *next;
+
+    if (!dev->multiq)
+        return smp_load_acquire(&dev->ring.head) != dev->ring.tail ? &dev->ring : NULL;
+    list_for_each_entry_safe(sub, next, &dev->subs, node)
+    {
+        /* acquire pairs with the writer's release: the bytes before head are visible */
+        if (smp_load_acquire(&sub->ring.head) != sub->ring.tail) {
+            list_move_tail(&sub->node, &dev->subs);
+            return &sub->ring;
+        }
+        if (sub->orphan) {
+            list_del(&sub->node);
+            scull_p_sub_free(sub);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Copy out of r, rlock held: up to count bytes of the stream, or one record in
+ * packet mode (whatever does not fit in buf is dropped). Returns the bytes copied.
+ */
+static long scull_p_take(struct scull_pipe *dev, struct scull_p_ring *r, char __user *buf, size_t count)
+{
+    unsigned int head = smp_load_acquire(&r->head);
+    unsigned int tail = r->tail, n, consumed;
+    long len;
+
+    if (dev->packet)
+    {
+        len = scull_p_rec_len(r, head, tail);
+        if (len < 0)
+            return len;
+        n = min_t(size_t, count, len);
+        consumed = SCULL_P_REC_HDR + len;
+        tail += SCULL_P_REC_HDR;
+    }
+    else
+    {
+        n = min_t(size_t, count, head - tail);
+        consumed = n;
+    }
+
+    /* copy to the user, across the wrap if there is one */
+    if (scull_p_copy_out(r, tail, buf, n))
         return -EFAULT;
+    scull_p_consume(dev, r, r->tail + consumed);
+    return n;
+}
 
+static ssize_t scull_p_do_read(struct file *filp, char __user *buf, size_t count)
+{
+    struct scull_pipe *dev = scull_p_dev(filp);
+    struct scull_p_ring *r;
+    size_t copied = 0;
+    long ret;
+
+    /* like pipe_read(): nothing asked, nothing taken (a record would be dropped whole) */
+    if (!count)
+        return 0;
+    ret = scull_p_wait_data(dev, filp->f_flags & O_NONBLOCK, count);
+    if (ret <= 0)
+        return ret;
+    /* a stream read keeps going to the next sub-ring until buf is full */
+    ret = 0;
+    while ((r = scull_p_next_ring(dev)))
+    {
+        ret = scull_p_take(dev, r, buf + copied, count - copied);
+        if (ret < 0)
+            break;
+        copied += ret;
+        if (dev->packet || copied == count)
+            break;
     }
-    dev->rp += count;
-    if (dev->rp == dev->end)
-        dev->rp = dev->start; // * if end of buffer reset read pointer
-    up(&dev->sem);
-    // Wake up any writers waiting for space
-    wake_up_interruptible(&dev->outq);
-    pr_info("%s did read %li bytes\n", current->comm, (long int)count);
-    return count;
+    mutex_unlock(&dev->rlock);
+    return copied ? copied : ret;
+}
+
+static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    ssize_t ret = scull_p_do_read(filp, buf, count);
+
+    trace_scull_p_read(scull_p_dev(filp), count, ret);
+    return ret;
 }
 
-static int get_spacefree(struct scull_pipe * dev)
+/* SCULL_P_IOCRDBATCH: as many whole records as fit in one kernel entry */
+static long scull_p_read_batch(struct file *filp, struct scull_p_batch __user *ubatch)
 {
-    if (dev->rp == dev->wp) //emtpy
-        return dev->buffersize -1; // we cant write over rp - 1 comes in
-    return  (dev->rp - dev->wp + dev->buffersize) % dev->buffersize - 1;
+    struct scull_pipe *dev = scull_p_dev(filp);
+    struct scull_p_ring *r;
+    struct scull_p_batch batch;
+    char __user *ubuf;
+    __u32 __user *ulens;
+    unsigned int head, tail;
+    long len, ret;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (!READ_ONCE(dev->packet))
+        return -EINVAL;
+    ubuf = u64_to_user_ptr(batch.buf);
+    ulens = u64_to_user_ptr(batch.lens);
+    batch.nrecs = batch.bytes = 0;
+
+    ret = scull_p_wait_data(dev, filp->f_flags & O_NONBLOCK, batch.buflen);
+    if (ret < 0)
+        return ret;
+    if (ret > 0)
+    {
+        ret = 0;
+        /* one record per turn, so in multi-queue mode the sub-rings interleave */
+        while (batch.nrecs < batch.max_recs && (r = scull_p_next_ring(dev)))
+        {
+            head = smp_load_acquire(&r->head);
+            tail = r->tail;
+            len = scull_p_rec_len(r, head, tail);
+            if (len < 0) {
+                ret = len;
+                break;
+            }
+            if (len > batch.buflen - batch.bytes) {
+                if (!batch.nrecs)
+                    ret = -EMSGSIZE; // would have to drop it: let the caller grow buf
+                break;
+            }
+            if (scull_p_copy_out(r, tail + SCULL_P_REC_HDR, ubuf + batch.bytes, len) ||
+                put_user((__u32)len, ulens + batch.nrecs)) {
+                ret = -EFAULT;
+                break;
+            }
+            scull_p_consume(dev, r, tail + SCULL_P_REC_HDR + len);
+            batch.bytes += len;
+            batch.nrecs++;
+        }
+        mutex_unlock(&dev->rlock);
+    }
+    /* records already taken off the ring are reported even if a later one failed */
+    if (batch.nrecs)
+        ret = batch.nrecs;
+    if (put_user(batch.nrecs, &ubatch->nrecs) || put_user(batch.bytes, &ubatch->bytes))
+        return -EFAULT;
+    return ret;
 }
-static int get_write_space(struct scull_pipe *dev, struct file *filp)
+
+/*
+ * Wait until need bytes can be written to r.
+ * Called and returns with wlock held on success; on error wlock is dropped.
+ */
+static int get_write_space(struct scull_pipe *dev, struct scull_p_ring *r, struct mutex *wlock,
+                           bool nonblock, unsigned int need)
 {
-    while (get_spacefree(dev) == 0) // buffer is full
+    unsigned int room_seq = atomic_read(&dev->room_seq);
+    unsigned int tail = smp_load_acquire(&r->tail);
+
+    while (scull_p_writable(r) < need) // buffer is full (or the free part is still lent to a pipe)
     {
         DEFINE_WAIT(wait);
-        up(&dev->sem);
-        if (filp->f_flags & O_NONBLOCK) // non-block return immediately
+        mutex_unlock(wlock);
+        if (nonblock) // non-block return immediately
             return -EAGAIN;
-        pr_info("%s writing: going to sleep\n", current->comm);
+        trace_scull_p_sleep(dev, true, need);
         prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-        if (get_spacefree(dev) == 0)
+        /* a consumer of the mapping only hands space back when asked */
+        if (r == &dev->ring && READ_ONCE(dev->mctl)) {
+            WRITE_ONCE(dev->mctl->writer_waits, 1);
+            smp_mb(); // pairs with the consumer's fence between moving its tail and reading the flag
+        }
+        /* sleep unless a reader or a pipe gave something back since we looked */
+        if (READ_ONCE(r->tail) == tail && atomic_read(&dev->room_seq) == room_seq)
             schedule();
         finish_wait(&dev->outq, &wait);
 
         if (signal_pending(current))
             return -ERESTARTSYS;
-        if (down_interruptible(&dev->sem))
+        if (mutex_lock_interruptible(wlock))
             return -ERESTARTSYS;
+        room_seq = atomic_read(&dev->room_seq);
+        tail = smp_load_acquire(&r->tail);
     }
     return 0;
 
 }
-static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t scull_p_do_write(struct file *filp, const char __user *buf, size_t count)
 {
-    struct scull_pipe *dev = filp->private_data;
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    /* a multi-queue writer has a ring (and a lock) nobody else writes to */
+    struct scull_p_ring *r = pf->sub ? &pf->sub->ring : &dev->ring;
+    struct mutex *wlock = pf->sub ? &pf->sub->wlock : &dev->wlock;
+    bool nonblock = filp->f_flags & O_NONBLOCK;
+    struct scull_p_rec_hdr hdr;
+    unsigned int head, n, need, hlen = 0;
     int result;
-    if (down_interruptible(&dev->sem))
+    if (mutex_lock_interruptible(wlock))
         return -ERESTARTSYS;
+    if (dev->packet)
+    {
+        /* a record goes in whole or not at all */
+        if (count > r->size - SCULL_P_REC_HDR) {
+            mutex_unlock(wlock);
+            return -EMSGSIZE;
+        }
+        if (!count) {
+            mutex_unlock(wlock);
+            return 0;
+        }
+        hlen = SCULL_P_REC_HDR;
+        need = hlen + count;
+    }
+    else
+    {
+        /* a stream takes what fits: the send watermark when blocking, any room when not */
+        need = nonblock ? 1 : min_t(size_t, scull_p_wlowat(dev), count);
+    }
     /* Make sure ther is space to write */
-    result = get_write_space(dev, filp);
+    result = get_write_space(dev, r, wlock, nonblock, need);
     if (result) return result; // if error return it
-    /* space is now available, buffer is locked */
+    /* space is now available, other writers are locked out */
 
-    /* Determine how much to write - dont overfill the buffer */
-    count = min(count, (size_t)get_spacefree(dev));
-    /* Is the WP ahead of RP? That is is it near end of buffer/ wraps around */
-    if (dev->wp >= dev->rp)
+    head = r->head;
+    /* Determine how much to write - dont overfill the buffer (writable acquires tail) */
+    n = min_t(size_t, count, scull_p_writable(r) - hlen);
+    if (scull_p_copy_in(r, head + hlen, buf, n))
     {
-        size_t bytes_to_end = dev->end - dev->wp;
-        if (bytes_to_end > 0)
-            count = min(count, (size_t)(bytes_to_end));
-    }else
+        mutex_unlock(wlock);
+        return -EFAULT;
+    }
+    if (hlen) {
+        hdr.len = n;
+        scull_p_copy_in_kernel(r, head, (const char *)&hdr, hlen);
+    }
+    scull_p_publish(dev, r, head + hlen + n);
+    mutex_unlock(wlock);
+    scull_p_wrote(dev, hlen + n);
+    return n;
+}
+
+static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    ssize_t ret = scull_p_do_write(filp, buf, count);
+
+    trace_scull_p_write(scull_p_dev(filp), count, ret);
+    return ret;
+}
+
+/*
+ * splice from the scull pipe into a real pipe (or a socket via sendfile) without copying:
+ * the pipe_buffers point at the ring pages themselves. The bytes count as read right away
+ * (tail moves), but a pin keeps writers off them until the pipe lets go.
+ */
+static ssize_t scull_p_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+                                   size_t len, unsigned int flags)
+{
+    struct scull_pipe *dev = scull_p_dev(filp);
+    struct scull_p_ring *r = &dev->ring;
+    struct scull_p_buf *b;
+    struct scull_p_pin *pin;
+    unsigned int head, tail, start;
+    ssize_t total = 0;
+    int ret;
+
+    /* a pipe has no notion of our record boundaries */
+    if (READ_ONCE(dev->packet))
+        return -EINVAL;
+    pin = kmalloc(sizeof(*pin), GFP_KERNEL);
+    if (!pin)
+        return -ENOMEM;
+    ret = scull_p_wait_data(dev, (filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK), len);
+    if (ret <= 0) {
+        kfree(pin);
+        return ret;
+    }
+    /* sub-rings are not lent out: a pin only guards the ring */
+    if (dev->multiq) {
+        mutex_unlock(&dev->rlock);
+        kfree(pin);
+        return -EINVAL;
+    }
+    b = r->buf;
+    head = smp_load_acquire(&r->head);
+    start = tail = r->tail;
+    len = min_t(size_t, len, head - tail);
+    /* one ref for the range as a whole until the loop has handed it out */
+    atomic_set(&pin->refs, 1);
+    pin->buf = b;
+    pin->start = start;
+    kref_get(&b->ref);
+    pin->file = get_file(filp);
+    spin_lock(&b->pin_lock);
+    list_add_tail(&pin->node, &b->pins); // tail only grows, so the list stays oldest first
+    spin_unlock(&b->pin_lock);
+
+    /* the caller holds the pipe lock; one pipe_buffer per ring page touched */
+    while (len && !pipe_full(pipe->head, pipe->tail, pipe->max_usage))
+    {
+        unsigned int off = tail & (r->size - 1);
+        unsigned int poff = offset_in_page(off);
+        unsigned int n = min_t(size_t, len, PAGE_SIZE - poff);
+        struct pipe_buffer *pbuf = pipe_head_buf(pipe);
+        struct page *page = b->pages[off >> PAGE_SHIFT];
+
+        get_page(page);
+        atomic_inc(&pin->refs);
+        *pbuf = (struct pipe_buffer) {
+            .ops = &scull_p_pipe_buf_ops,
+            .page = page,
+            .offset = poff,
+            .len = n,
+            .private = (unsigned long)pin,
+        };
+        pipe->head++;
+        tail += n;
+        len -= n;
+        total += n;
+    }
+    scull_p_consume(dev, r, tail);
+    mutex_unlock(&dev->rlock);
+    scull_p_pin_put(pin); // drops the loop's ref (and the whole pin if nothing was spliced)
+    /* data is queued but the pipe had no room: 0 would read as EOF */
+    return total ? total : -EAGAIN;
+}
+
+/*
+ * splice_from_pipe actor: copy one pipe_buffer into the ring, as much as fits.
+ * wlock is taken per buffer only: between buffers splice_from_pipe may sleep waiting for
+ * the pipe to fill, and other writers of the device must not wait behind that.
+ */
+static int scull_p_splice_actor(struct pipe_inode_info *pipe, struct pipe_buffer *pbuf,
+                                struct splice_desc *sd)
+{
+    struct scull_pipe *dev = scull_p_dev(sd->u.file);
+    struct scull_p_ring *r = &dev->ring;
+    bool nonblock = (sd->u.file->f_flags & O_NONBLOCK) || (sd->flags & SPLICE_F_NONBLOCK);
+    unsigned int head, n;
+    char *src;
+    int ret;
+
+    if (mutex_lock_interruptible(&dev->wlock))
+        return -ERESTARTSYS;
+    ret = get_write_space(dev, r, &dev->wlock, nonblock, 1); // another writer may have filled it
+    if (ret)
+        return ret; // -EAGAIN or a signal: splice returns what was done so far, if anything
+    head = r->head;
+    n = min_t(unsigned int, sd->len, scull_p_writable(r));
+    src = kmap_local_page(pbuf->page);
+    scull_p_copy_in_kernel(r, head, src + pbuf->offset, n);
+    kunmap_local(src);
+    scull_p_publish(dev, r, head + n);
+    mutex_unlock(&dev->wlock);
+    scull_p_wrote(dev, n);
+    return n;
+}
+/*
+ * splice from a pipe into the scull pipe: a single kernel copy per pipe_buffer
+ * (no bounce through userspace). The ring is one vmapped area, so adopting the
+ * pipe's pages by reference would mean remapping it; we copy instead.
+ */
+static ssize_t scull_p_splice_write(struct pipe_inode_info *pipe, struct file *filp, loff_t *ppos,
+                                    size_t len, unsigned int flags)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    bool nonblock = (filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK);
+    ssize_t ret;
+
+    if (READ_ONCE(dev->packet) || pf->sub)
+        return -EINVAL;
+    /* honour the send watermark up front; the actor then takes wlock buffer by buffer */
+    if (mutex_lock_interruptible(&dev->wlock))
+        return -ERESTARTSYS;
+    ret = get_write_space(dev, &dev->ring, &dev->wlock, nonblock, nonblock ? 1 : min_t(size_t, scull_p_wlowat(dev), len));
+    if (ret)
+        return ret;
+    mutex_unlock(&dev->wlock);
+    return splice_from_pipe(pipe, filp, ppos, len, flags, scull_p_splice_actor);
+}
+
+/*
+ * Swap in a ring of a different size with the queued bytes preserved.
+ * head/tail keep their values: each byte is moved to the slot its index
+ * masks to in the new ring, so lockless readers of the indices never see
+ * them jump.
+ */
+static long scull_p_resize(struct scull_pipe *dev, unsigned long arg)
+{
+    struct scull_p_ring *r = &dev->ring;
+    struct scull_p_buf *nbuf, *old;
+    unsigned int size, pos, used;
+    long ret;
+
+    if (arg == 0 || arg > SCULL_P_HARD_MAX_BUFFER)
+        return -EINVAL;
+    if (arg > scull_p_max_buffer && !capable(CAP_SYS_RESOURCE))
+        return -EPERM;
+    size = scull_p_round_size(arg);
+    /* allocate before taking any lock, it can be many MiB */
+    nbuf = scull_p_buf_alloc(dev, size);
+    if (!nbuf)
+        return -ENOMEM;
+
+    if (down_interruptible(&dev->sem)) {
+        scull_p_buf_put(nbuf);
+        return -ERESTARTSYS;
+    }
+    /* stop both sides: no copy may run against the old storage */
+    mutex_lock(&dev->wlock);
+    mutex_lock(&dev->rlock);
+    old = r->buf;
+    used = r->head - r->tail;
+    /* sub-rings are sized when their writer opens and must all match the ring */
+    /* mapped pages must stay the ring's */
+    if (used > size || !list_empty(&dev->subs) || atomic_read(&dev->mapped))
     {
-        // writer pointer wrapper , free space is just before rp
-        count = min(count, (size_t)(dev->rp - dev->wp - 1));
+        ret = -EBUSY;
+        old = nbuf; // give back the new one
+        goto out;
     }
-    pr_info("Going to accept %li bytes to %p from %p\n", count, dev->wp, buf);
-    if (copy_from_user(dev->wp, buf, count))
+    for (pos = r->tail; pos != r->head; )
     {
-        up(&dev->sem);
-        return -EFAULT;
+        unsigned int soff = pos & (r->size - 1), doff = pos & (size - 1);
+        unsigned int n = min3(r->head - pos, r->size - soff, size - doff);
+        memcpy(nbuf->data + doff, old->data + soff, n);
+        pos += n;
     }
-    dev->wp += count;
-    if (dev->wp == dev->end)
-        dev->wp = dev->start; // wrap around
+    r->buf = nbuf;
+    WRITE_ONCE(r->size, size);
+    dev->buffersize = size;
+    ret = size;
+out:
+    mutex_unlock(&dev->rlock);
+    mutex_unlock(&dev->wlock);
     up(&dev->sem);
-    /* wake up any reader */
-    wake_up_interruptible(&dev->inq);
-    /* signal asynchronous readers, if any */
-    if (dev->fasync_queue)
-        kill_fasync(&dev->fasync_queue, SIGIO, POLL_IN);
-    pr_info("%s did write %li bytes\n", current->comm, (long int)count);
-    return count;
+    if (ret > 0)
+        atomic_inc(&dev->room_seq);
+    /* pages still lent to pipes keep the old storage alive until they come back */
+    scull_p_buf_put(old);
+    /* a bigger ring may have room for a blocked writer */
+    scull_p_wake_writers(dev);
+    return ret;
+}
+
+/*
+ * switch between byte stream and records: only on an empty ring, so nothing is misparsed;
+ * dev->sem orders it against an O_DIRECT open setting the mode, as in scull_p_resize()
+ */
+static long scull_p_set_packet(struct scull_pipe *dev, bool packet)
+{
+    long ret = 0;
+
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    mutex_lock(&dev->wlock);
+    mutex_lock(&dev->rlock);
+    /* multi-queue writers do not take wlock, so none may be open */
+    if (dev->ring.head != dev->ring.tail || !list_empty(&dev->subs))
+        ret = -EBUSY;
+    else
+        WRITE_ONCE(dev->packet, packet);
+    if (!ret && dev->mctl)
+        WRITE_ONCE(dev->mctl->packet, packet);
+    mutex_unlock(&dev->rlock);
+    mutex_unlock(&dev->wlock);
+    up(&dev->sem);
+    return ret;
+}
+
+/* turning stamping on starts a fresh histogram */
+static long scull_p_set_timestamp(struct scull_pipe *dev, bool on)
+{
+    if (mutex_lock_interruptible(&dev->rlock))
+        return -ERESTARTSYS;
+    if (on && !dev->timestamp) {
+        memset(dev->lat_hist, 0, sizeof(dev->lat_hist));
+        atomic_long_set(&dev->lat_missed, 0);
+    }
+    WRITE_ONCE(dev->timestamp, on);
+    mutex_unlock(&dev->rlock);
+    return 0;
+}
+
+/*
+ * Switch multi-queue mode. Writer files pick their ring at open, so no writer may be
+ * open, and the ring we stop reading from must be empty (a leftover sub-ring is only
+ * there while it still has bytes).
+ */
+static long scull_p_set_multiq(struct scull_pipe *dev, bool multiq)
+{
+    long ret = 0;
+
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    mutex_lock(&dev->wlock);
+    mutex_lock(&dev->rlock);
+    if (dev->nwriters || dev->ring.head != dev->ring.tail || !list_empty(&dev->subs) ||
+        atomic_read(&dev->mapped))
+        ret = -EBUSY;
+    else
+        WRITE_ONCE(dev->multiq, multiq);
+    mutex_unlock(&dev->rlock);
+    mutex_unlock(&dev->wlock);
+    up(&dev->sem);
+    return ret;
 }
 
-static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
+/* SCULL_P_IOCTTAIL: a consumer of the mapping is done with everything before tail */
+static long scull_p_mmap_tail(struct file *filp, unsigned int tail)
+{
+    struct scull_pipe *dev = scull_p_dev(filp);
+    struct scull_p_ring *r = &dev->ring;
+    long ret = 0;
+
+    if (!(filp->f_mode & FMODE_READ))
+        return -EBADF;
+    if (mutex_lock_interruptible(&dev->rlock))
+        return -ERESTARTSYS;
+    if (!dev->mctl || dev->multiq)
+        ret = -EINVAL;
+    else if (tail - r->tail > smp_load_acquire(&r->head) - r->tail) // never trust the caller's index
+        ret = -EINVAL;
+    else {
+        WRITE_ONCE(dev->mctl->writer_waits, 0);
+        scull_p_consume(dev, r, tail); // wakes the writers the flag was raised for
+    }
+    mutex_unlock(&dev->rlock);
+    return ret;
+}
+/* SCULL_P_IOCTHEAD: a producer stored data through the mapping up to head */
+static long scull_p_mmap_head(struct file *filp, unsigned int head)
+{
+    struct scull_pipe *dev = scull_p_dev(filp);
+    struct scull_p_ring *r = &dev->ring;
+    unsigned int n = 0;
+    long ret = 0;
+
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (mutex_lock_interruptible(&dev->wlock))
+        return -ERESTARTSYS;
+    if (!dev->mctl || dev->multiq)
+        ret = -EINVAL;
+    else if (head - r->head > scull_p_writable(r)) // would overwrite unread (or spliced) bytes
+        ret = -EINVAL;
+    else {
+        n = head - r->head;
+        scull_p_publish(dev, r, head);
+    }
+    mutex_unlock(&dev->wlock);
+    if (n)
+        scull_p_wrote(dev, n);
+    return ret;
+}
+
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_pipe *dev = scull_p_dev(filp);
+    /*
+     * quantum/qset ioctls are shared with the other scull devices; a batch runs on the
+     * file's scull_dev, and private_data here is a scull_p_file, so it is not one of them
+     */
+    if (cmd == SCULL_IOCBATCH)
+        return -ENOTTY;
+    if (_IOC_TYPE(cmd) != SCULL_P_IOC_MAGIC)
+        return scull_ioctl(filp, cmd, arg);
+    if (_IOC_NR(cmd) > SCULL_P_IOC_MAXNR)
+        return -ENOTTY;
+
+    switch (cmd)
+    {
+    /* "Tell" size via arg value, returns what was allocated */
+    case SCULL_P_IOCTSIZE:
+        return scull_p_resize(dev, arg);
+    /* "Query" size via return value */
+    case SCULL_P_IOCQSIZE:
+        return READ_ONCE(dev->ring.size);
+    /* watermarks: a lower one may already be met, so let sleepers recheck */
+    case SCULL_P_IOCTRCVLOWAT:
+        WRITE_ONCE(dev->rcvlowat, clamp_t(unsigned long, arg, 1, SCULL_P_HARD_MAX_BUFFER));
+        scull_p_wake_readers(dev, 0);
+        return 0;
+    case SCULL_P_IOCQRCVLOWAT:
+        return READ_ONCE(dev->rcvlowat);
+    case SCULL_P_IOCTSNDLOWAT:
+        WRITE_ONCE(dev->sndlowat, clamp_t(unsigned long, arg, 1, SCULL_P_HARD_MAX_BUFFER));
+        atomic_inc(&dev->room_seq);
+        scull_p_wake_writers(dev);
+        return 0;
+    case SCULL_P_IOCQSNDLOWAT:
+        return READ_ONCE(dev->sndlowat);
+    case SCULL_P_IOCTPACKET:
+        return scull_p_set_packet(dev, arg != 0);
+    case SCULL_P_IOCQPACKET:
+        return READ_ONCE(dev->packet);
+    case SCULL_P_IOCRDBATCH:
+        return scull_p_read_batch(filp, (struct scull_p_batch __user *)arg);
+    case SCULL_P_IOCTMULTIQ:
+        return scull_p_set_multiq(dev, arg != 0);
+    case SCULL_P_IOCQMULTIQ:
+        return READ_ONCE(dev->multiq);
+    /* busy-poll budget in microseconds, capped by the scull_p_max_busy_poll module parameter */
+    case SCULL_P_IOCTBUSYPOLL:
+        WRITE_ONCE(dev->busy_poll_us, min_t(unsigned long, arg, max(READ_ONCE(scull_p_max_busy_poll), 0)));
+        return dev->busy_poll_us;
+    case SCULL_P_IOCQBUSYPOLL:
+        return READ_ONCE(dev->busy_poll_us);
+    case SCULL_P_IOCTTSTAMP:
+        return scull_p_set_timestamp(dev, arg != 0);
+    case SCULL_P_IOCQTSTAMP:
+        return READ_ONCE(dev->timestamp);
+    case SCULL_P_IOCTTAIL:
+        return scull_p_mmap_tail(filp, arg);
+    case SCULL_P_IOCTHEAD:
+        return scull_p_mmap_head(filp, arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static __poll_t scull_p_poll(struct file *filp, poll_table *wait)
 {
     /*
      * poll_wait(filp, &dev->inq/outq, wait) does NOT sleep.
@@ -151,49 +1136,180 @@ static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
      *   2. Return a mask of readiness bits (POLLIN/POLLOUT/etc).
      * If no events are ready (mask == 0), the core will put the task to sleep
      * until a wake_up_interruptible_poll() is issued on one of the queues.
+     *
+     * No lock here: every value looked at is a single word the paths that change it
+     * publish with WRITE_ONCE/release, and a stale answer is fixed by the next wakeup.
     */
 
 
-    struct scull_pipe *dev = filp->private_data;
-    unsigned int mask = 0;
-    down(&dev->sem);
-    // register the wait queues with the poll system
-    poll_wait(filp, &dev->inq, wait);
-    poll_wait(filp, &dev->outq, wait);
-    // at this point, if the process going to sleep, it will be on inq and outq
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    __poll_t events = poll_requested_events(wait);
+    __poll_t mask = 0;
+    unsigned long used;
+    int nwriters;
+    // register only on the queues for what the caller asked about
+    if (events & (EPOLLIN | EPOLLRDNORM))
+        poll_wait(filp, &dev->inq, wait);
+    if (events & (EPOLLOUT | EPOLLWRNORM))
+        poll_wait(filp, &dev->outq, wait);
+    // pairs with wq_has_sleeper() in the wakers: we are queued before we look at the ring
+    smp_mb();
     // check current status:
-    if (dev->rp != dev->wp) // not empty
-        mask |= POLLIN | POLLRDNORM; // readable: data available
-    if (get_spacefree(dev))
-        mask |= POLLOUT | POLLWRNORM; // writeable: space available
-    if (dev->rp == dev->wp && dev->nwriters == 0) // emtpy and no writer
-        mask |= POLLHUP | POLLIN; // device is in hangup state, also mark it as readable
-    up(&dev->sem);
+    used = scull_p_queued(dev);
+    nwriters = READ_ONCE(dev->nwriters);
+    if (used >= scull_p_rlowat(dev) || (used && nwriters == 0)) // enough queued, or the last bytes
+        mask |= EPOLLIN | EPOLLRDNORM; // readable: data available
+    // a multi-queue writer only cares about its own sub-ring
+    if (scull_p_space(pf->sub ? &pf->sub->ring : &dev->ring) >= scull_p_wlowat(dev))
+        mask |= EPOLLOUT | EPOLLWRNORM; // writeable: space available
+    else if ((events & EPOLLOUT) && !pf->sub && READ_ONCE(dev->mctl))
+        WRITE_ONCE(dev->mctl->writer_waits, 1); // ask a consumer of the mapping for room
+    if (!used && nwriters == 0) // emtpy and no writer
+        mask |= EPOLLHUP | EPOLLIN; // device is in hangup state, also mark it as readable
     return mask;
 }
 static int scull_p_fasync(int fd, struct file *filp, int on)
 {
     // register/de-register on async queue to be notified when kill_async called
-    struct scull_pipe *dev = filp->private_data;
+    struct scull_pipe *dev = scull_p_dev(filp);
     return fasync_helper(fd, filp, on, &dev->fasync_queue);
 }
 
+static void scull_p_vma_open(struct vm_area_struct *vma)
+{
+    // also called for the copy in a forked child
+    struct scull_pipe *dev = vma->vm_private_data;
+    atomic_inc(&dev->mapped);
+}
+static void scull_p_vma_close(struct vm_area_struct *vma)
+{
+    struct scull_pipe *dev = vma->vm_private_data;
+    atomic_dec(&dev->mapped);
+}
+/* page offset 0 is the control page, then the ring pages in order */
+static vm_fault_t scull_p_vma_fault(struct vm_fault *vmf)
+{
+    struct scull_pipe *dev = vmf->vma->vm_private_data;
+    struct scull_p_buf *b = READ_ONCE(dev->ring.buf); // cannot be swapped while mapped
+    pgoff_t pgoff = vmf->pgoff;
+    struct page *page;
+
+    if (pgoff == 0)
+        page = dev->ctl_page;
+    else if (b && pgoff - SCULL_P_MMAP_DATA_PGOFF < b->nr_pages)
+        page = b->pages[pgoff - SCULL_P_MMAP_DATA_PGOFF];
+    else
+        return VM_FAULT_SIGBUS;
+    // install the pte ourselves, the page ref it takes keeps the page alive
+    return vmf_insert_page(vmf->vma, vmf->address, page);
+}
+
+static const struct vm_operations_struct scull_p_vm_ops = {
+    .open = scull_p_vma_open,
+    .close = scull_p_vma_close,
+    .fault = scull_p_vma_fault,
+};
+
+/*
+ * Map the ring for consumers that read records in place and producers that write them in
+ * place. The control page is never writable: the kernel keeps the only trusted head/tail
+ * and userspace reports its progress with SCULL_P_IOCTTAIL / SCULL_P_IOCTHEAD.
+ * Writable data pages need a writable open, the VFS checks that for MAP_SHARED.
+ */
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct scull_pipe *dev = scull_p_dev(filp);
+    struct scull_p_ring *r = &dev->ring;
+    int ret = 0;
+
+    if (!(vma->vm_flags & VM_SHARED)) // a private copy would never see the ring move
+        return -EINVAL;
+    if (vma->vm_pgoff == 0 && (vma->vm_flags & VM_WRITE))
+        return -EPERM;
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    if (dev->multiq || vma->vm_pgoff + vma_pages(vma) > SCULL_P_MMAP_DATA_PGOFF + (r->size >> PAGE_SHIFT)) {
+        ret = -EINVAL;
+        goto out;
+    }
+    if (!dev->ctl_page)
+    {
+        dev->ctl_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!dev->ctl_page) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        // fill it in with both sides stopped, so no head/tail update is missed
+        mutex_lock(&dev->wlock);
+        mutex_lock(&dev->rlock);
+        dev->mctl = page_address(dev->ctl_page);
+        dev->mctl->head = r->head;
+        dev->mctl->tail = r->tail;
+        dev->mctl->size = r->size;
+        dev->mctl->packet = dev->packet;
+        mutex_unlock(&dev->rlock);
+        mutex_unlock(&dev->wlock);
+    }
+    if (vma->vm_pgoff == 0)
+        vm_flags_clear(vma, VM_MAYWRITE); // no mprotect() back to writable either
+    vma->vm_ops = &scull_p_vm_ops;
+    vma->vm_private_data = dev;
+    /*  VM_MIXEDMAP for vmf_insert_page */
+    vm_flags_set(vma, VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_ops->open(vma);
+out:
+    up(&dev->sem);
+    return ret;
+}
+
 static int scull_p_open(struct inode *inode, struct file *filp){
     struct scull_pipe *device = container_of(inode->i_cdev, struct scull_pipe, cdev);
-    filp->private_data = device;
-    if (down_interruptible(&device->sem))
+    struct scull_p_file *pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+    if (!pf)
+        return -ENOMEM;
+    pf->dev = device;
+    filp->private_data = pf;
+    if (down_interruptible(&device->sem)) {
+        kfree(pf);
         return -ERESTARTSYS;
-    if (!device->start)
+    }
+    if (!device->ring.buf)
+    {
+        // allocate the ring with this pipe's size (set by SCULL_P_IOCTSIZE or the module default)
+        device->ring.buf = scull_p_buf_alloc(device, device->buffersize);
+        if (!device->ring.buf){
+            up(&device->sem);
+            kfree(pf);
+            return -ENOMEM;
+        }
+        device->ring.size = device->buffersize;
+        device->ring.head = device->ring.tail = 0;
+        device->ring.mhead = device->ring.mtail = 0;
+    }
+    /* O_DIRECT asks for packet mode, like pipe2(O_DIRECT); it is per pipe, so only an idle one can switch */
+    if (filp->f_flags & O_DIRECT)
     {
-        // allocate the device
-        device->start = kmalloc(scull_p_buffer, GFP_KERNEL);
-        if (!device->start){
+        if (!device->packet && (device->nreaders || device->nwriters)) {
             up(&device->sem);
+            kfree(pf);
+            return -EBUSY;
+        }
+        device->packet = true;
+        filp->f_mode |= FMODE_CAN_ODIRECT; // otherwise the VFS refuses O_DIRECT on a char device
+    }
+    // a multi-queue writer gets its own sub-ring, appended to the reader's rotation
+    if (device->multiq && (filp->f_mode & FMODE_WRITE))
+    {
+        pf->sub = scull_p_sub_alloc(device);
+        if (!pf->sub) {
+            up(&device->sem);
+            kfree(pf);
             return -ENOMEM;
         }
-        device->buffersize = scull_p_buffer;
-        device->end = device->start + device->buffersize;
-        device->rp = device->wp = device->start;
+        mutex_lock(&device->rlock);
+        list_add_tail(&pf->sub->node, &device->subs);
+        mutex_unlock(&device->rlock);
     }
     //* use f_mode -> standarized
     if (filp->f_mode & FMODE_WRITE)
@@ -207,21 +1323,48 @@ static int scull_p_open(struct inode *inode, struct file *filp){
 }
 static int scull_p_release(struct inode *inode,  struct file *filp)
 {
-    struct scull_pipe *dev = filp->private_data;
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    struct scull_p_sub *sub, *next;
     // remove this filp from async notified filps
     scull_p_fasync(-1, filp, 0);
     down(&dev->sem);
+    if (pf->sub)
+    {
+        // what this writer left is still the reader's to drain
+        mutex_lock(&dev->rlock);
+        if (pf->sub->ring.head == pf->sub->ring.tail) {
+            list_del(&pf->sub->node);
+            scull_p_sub_free(pf->sub);
+        } else {
+            pf->sub->orphan = true;
+        }
+        mutex_unlock(&dev->rlock);
+    }
     if (filp->f_mode & FMODE_WRITE)
         if (--dev->nwriters == 0)
-            wake_up_interruptible(&dev->inq);  // let readers see EOF
+            scull_p_wake_readers(dev, EPOLLHUP);  // let readers see EOF
     if (filp->f_mode & FMODE_READ)
         dev->nreaders--;
     if (dev->nreaders == 0 && dev->nwriters == 0)
     {
-        kfree(dev->start);
-        dev->start = NULL;
+        scull_p_buf_put(dev->ring.buf);
+        dev->ring.buf = NULL;
+        // nobody is left to read what the writers left behind
+        list_for_each_entry_safe(sub, next, &dev->subs, node) {
+            list_del(&sub->node);
+            scull_p_sub_free(sub);
+        }
+        atomic_long_set(&dev->mq_queued, 0);
+        // every mapping holds the file, so none is left by now
+        if (dev->ctl_page) {
+            dev->mctl = NULL;
+            __free_page(dev->ctl_page);
+            dev->ctl_page = NULL;
+        }
     }
     up(&dev->sem);
+    kfree(pf);
     return 0;
 }
 
@@ -233,33 +1376,53 @@ const struct file_operations scull_pipe_fops ={
     .release = scull_p_release,
     .read = scull_p_read,
     .write = scull_p_write,
-    .unlocked_ioctl = scull_ioctl,
+    .unlocked_ioctl = scull_p_ioctl,
     .poll = scull_p_poll,
     .fasync = scull_p_fasync,
+    .splice_read = scull_p_splice_read,
+    .splice_write = scull_p_splice_write,
+    .mmap = scull_p_mmap,
 };
 
+/* one debugfs file per pipe: m->private is the scull_pipe */
 static int pipe_show(struct seq_file *m, void *v)
 {
-    int i;
-    struct scull_pipe *p;
-    #define LIMIT (PAGE_SIZE-200)        /* don't print any more after this size */
-    seq_printf(m, "Default buffersize is %i\n", scull_p_buffer);
-    for(i = 0; i<scull_p_nr_devs; i++) {
-        p = &scull_p_devices[i];
-        if (down_interruptible(&p->sem))
-            return -ERESTARTSYS;
-        seq_printf(m, "\nDevice %i: %p\n", i, p);
-        seq_printf(m, "   Buffer: %p to %p (%i bytes)\n", p->start, p->end, p->buffersize);
-        seq_printf(m, "   rp %p   wp %p\n", p->rp, p->wp);
-        seq_printf(m, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
-        up(&p->sem);
-    }
+    struct scull_pipe *p = m->private;
+    struct scull_p_sub *sub;
+    u64 samples = 0;
+    int b;
+    seq_printf(m, "Default buffersize is %i (max %i)\n", scull_p_buffer, scull_p_max_buffer);
+    if (down_interruptible(&p->sem))
+        return -ERESTARTSYS;
+    seq_printf(m, "\nDevice %i: %p\n", (int)(p - scull_p_devices), p);
+    seq_printf(m, "   Buffer: %p (%u bytes, %u pages, next open %u bytes)\n",
+               p->ring.buf ? p->ring.buf->data : NULL, p->ring.size,
+               p->ring.buf ? p->ring.buf->nr_pages : 0, p->buffersize);
+    seq_printf(m, "   head %u   tail %u   queued %u\n",
+               READ_ONCE(p->ring.head), READ_ONCE(p->ring.tail), scull_p_used(&p->ring));
+    seq_printf(m, "   readers %i   writers %i   mode %s%s\n", p->nreaders, p->nwriters,
+               p->packet ? "packet" : "stream", p->multiq ? ", multi-queue" : "");
+    mutex_lock(&p->rlock);
+    list_for_each_entry(sub, &p->subs, node)
+        seq_printf(m, "   sub-ring %p: head %u   tail %u   queued %u%s\n", sub,
+                   READ_ONCE(sub->ring.head), sub->ring.tail, scull_p_used(&sub->ring),
+                   sub->orphan ? "   (writer closed)" : "");
+    for (b = 0; b < SCULL_P_LAT_BUCKETS; b++)
+        samples += p->lat_hist[b];
+    seq_printf(m, "   latency (write to read, ns): %s   %llu samples   %ld not stamped\n",
+               p->timestamp ? "on" : "off", samples, atomic_long_read(&p->lat_missed));
+    for (b = 0; b < SCULL_P_LAT_BUCKETS; b++)
+        if (p->lat_hist[b])
+            seq_printf(m, "   %12llu - %-12llu %llu\n", b ? 1ULL << (b - 1) : 0ULL,
+                       b == SCULL_P_LAT_BUCKETS - 1 ? ~0ULL : (1ULL << b) - 1, p->lat_hist[b]);
+    mutex_unlock(&p->rlock);
+    up(&p->sem);
     return 0;
 }
 /* Boilerplate wrapper for single_open */
 static int my_open(struct inode *inode, struct file *file)
 {
-    return single_open(file, pipe_show, NULL);
+    return single_open(file, pipe_show, inode->i_private);
 }
 
 static const struct file_operations debug_fs_ops = {
@@ -298,9 +1461,16 @@ int scull_pipe_init(dev_t first_dev)
         p = scull_p_devices + i ;
         memset(tmp, 0, sizeof(tmp));
         scnprintf(tmp, sizeof(tmp), "pipe%d", i);
-        debugfs_create_file(tmp, 0644, debugfs_pipe_root, NULL, &debug_fs_ops);
-        // init sem
+        debugfs_create_file(tmp, 0644, debugfs_pipe_root, p, &debug_fs_ops);
+        // init sem and the per-side locks
         sema_init(&p->sem, 1);
+        mutex_init(&p->rlock);
+        mutex_init(&p->wlock);
+        INIT_LIST_HEAD(&p->subs);
+        atomic_long_set(&p->mq_queued, 0);
+        p->buffersize = scull_p_round_size(clamp_t(int, scull_p_buffer, PAGE_SIZE, SCULL_P_HARD_MAX_BUFFER));
+        p->rcvlowat = p->sndlowat = 1;
+        p->rwant = UINT_MAX;
         // setup cdev fops
         cdev_init(&p->cdev, &scull_pipe_fops);
         p->cdev.owner = THIS_MODULE;
@@ -314,6 +1484,8 @@ int scull_pipe_init(dev_t first_dev)
         //init wait queues
         init_waitqueue_head(&p->inq);
         init_waitqueue_head(&p->outq);
+        atomic_set(&p->room_seq, 0);
+        atomic_set(&p->mapped, 0);
         // creates /dev/scullp{i}
 
         struct device *d = device_create(pipe_cls, NULL, devno, NULL, "scullp%d", i);
@@ -342,7 +1514,7 @@ void scull_pipe_exit(void)
             // unregister file ops from cdev
             cdev_del(&p->cdev);
             device_destroy(pipe_cls,MKDEV(MAJOR(scull_p_devno), minor+i));
-            kfree(p->start);
+            scull_p_buf_put(p->ring.buf);
         }
     }
     // remove char region numbers
@@ -6,20 +6,106 @@
 #define LDD3_PRACTICE_SCULL_PIPE_H
 #include <linux/wait.h>
 #include <linux/semaphore.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/atomic.h>
 #include <linux/cdev.h>
 
+struct scull_pipe;
+struct scull_p_mmap_ctl;
+/*
+ * Page-backed ring storage: the pages are vmapped back to back so copies see one flat buffer.
+ * Refcounted because splice_read lends its pages to pipe_buffers, which can outlive
+ * a resize or the last close of the device.
+ */
+struct scull_p_buf {
+    struct page **pages; // backing pages
+    unsigned int nr_pages;
+    char *data; // kernel mapping of all pages
+    unsigned int size; // bytes, nr_pages * PAGE_SIZE
+    struct kref ref; // the ring holds one, every outstanding splice pin holds one
+    spinlock_t pin_lock; // protects pins
+    struct list_head pins; // ranges lent to pipes, oldest first; writers must not overwrite them
+    struct scull_pipe *dev; // owner, woken when a pin is dropped
+};
+
+/*
+ * Byte ring shared by the producer side and the consumer side.
+ * head/tail are free-running indices (wrap at 2^32), size is a power of two
+ * so "index & (size - 1)" is the offset into buf->data.
+ *   - head is only stored by writers, published with smp_store_release()
+ *   - tail is only stored by readers, published with smp_store_release()
+ * so one reader and one writer never need a common lock.
+ */
+/* one stamped write: its last byte ends before ring index pos, published at ts */
+struct scull_p_mark {
+    u64 ts; // ktime_get_ns()
+    unsigned int pos;
+};
+#define SCULL_P_NR_MARKS 128 // stamped writes in flight per ring, power of two
+#define SCULL_P_LAT_BUCKETS 40 // bucket b counts latencies in [2^(b-1), 2^b) ns, the last one everything above
+
+struct scull_p_ring {
+    struct scull_p_buf *buf; // ring storage, swapped by a resize
+    unsigned int size; // bytes, power of two (== buf->size, kept here for lockless checks)
+    unsigned int head; // next byte to write
+    unsigned int tail; // next byte to read
+    /* write timestamps, same single producer/single consumer scheme as head/tail */
+    struct scull_p_mark marks[SCULL_P_NR_MARKS];
+    unsigned int mhead; // next mark to fill, stored by writers
+    unsigned int mtail; // oldest mark not yet read past, stored by readers
+};
+
+/*
+ * Multi-queue mode: every writer file gets a ring of its own, so producers never share
+ * a lock or the head cache line; the reader fans the sub-rings in round-robin.
+ */
+struct scull_p_sub {
+    struct scull_p_ring ring; // this writer's bytes (or records)
+    struct mutex wlock; // threads writing through the same file
+    struct list_head node; // on dev->subs, moved to the back each time the reader serves it
+    bool orphan; // writer closed with bytes left: the reader frees it once drained
+};
+
+/* filp->private_data: the pipe, and the sub-ring a multi-queue writer feeds (else NULL) */
+struct scull_p_file {
+    struct scull_pipe *dev;
+    struct scull_p_sub *sub;
+};
+
 struct scull_pipe{
     wait_queue_head_t inq, outq; // Wait queues for readers and writers
-    char *start, *end; // star, end of circular buffer
-    int buffersize; // size of the buffer
-    char *rp, *wp; // read, write pointers
+    struct scull_p_ring ring; // circular buffer
+    unsigned int buffersize; // size to allocate the ring with on first open
+    unsigned int rcvlowat; // wake readers once this many bytes are queued
+    unsigned int rwant; // smallest amount a blocking reader below rcvlowat sleeps for (UINT_MAX: none)
+    unsigned int sndlowat; // wake writers once this many bytes are free
+    unsigned int busy_poll_us; // blocking readers spin this long before sleeping
+    bool timestamp; // stamp each write and record its write-to-read latency
+    u64 lat_hist[SCULL_P_LAT_BUCKETS]; // log2 latency histogram, updated under rlock
+    atomic_long_t lat_missed; // writes not stamped because the marks ring was full
+    struct page *ctl_page; // mmap control page, allocated on first mmap, freed on last close
+    struct scull_p_mmap_ctl *mctl; // its kernel address, set under wlock + rlock
+    atomic_t mapped; // vmas mapping the ring: it may not be resized or switched to multi-queue
+    bool packet; // ring holds scull_p_rec_hdr framed records instead of a byte stream
+    bool multiq; // writers feed their own sub-rings instead of ring
+    struct list_head subs; // sub-rings in multi-queue mode, protected by rlock
+    atomic_long_t mq_queued; // bytes queued over all sub-rings (never more than really there)
     int nreaders, nwriters; // number of open readers, writers
     struct fasync_struct *fasync_queue; // async notifier list (for SIGIO)
-    struct semaphore sem; // mutual exclusion semaphore
+    atomic_t room_seq; // bumped when writer room grows without tail moving (spliced pages returned, resize)
+    struct mutex rlock; // serializes readers against each other (uncontended with one reader)
+    struct mutex wlock; // serializes writers against each other (uncontended with one writer)
+    struct semaphore sem; // protects open/release bookkeeping and the ring allocation
+                          // lock order: sem -> wlock -> rlock
     struct cdev cdev; // char device structure
 };
 
+extern int scull_p_buffer;
+extern int scull_p_max_buffer;
+extern int scull_p_max_busy_poll;
 
 int scull_pipe_init(dev_t fist_dev);
 void scull_pipe_exit(void);
-#endif //LDD3_PRACTICE_SCULL_PIPE_H
\ No newline at end of file
+#endif //LDD3_PRACTICE_SCULL_PIPE_H
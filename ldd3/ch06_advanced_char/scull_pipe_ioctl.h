@@ -0,0 +1,89 @@
+#ifndef _SCULL_PIPE_IOCTL_H
+#define _SCULL_PIPE_IOCTL_H
+
+#include <linux/types.h>
+
+/* Packet mode ring format: every record is this header followed by len payload bytes,
+ * back to back with no padding (a header may wrap around the end of the ring) */
+struct scull_p_rec_hdr {
+    __u32 len;
+};
+
+/* SCULL_P_IOCRDBATCH: drain several whole records in one call */
+struct scull_p_batch {
+    __u64 buf;      /* userspace pointer: payloads are packed back to back here */
+    __u64 lens;     /* userspace pointer: __u32 array, one payload length per record */
+    __u32 buflen;   /* bytes available at buf */
+    __u32 max_recs; /* entries available at lens */
+    __u32 nrecs;    /* out: records returned */
+    __u32 bytes;    /* out: payload bytes copied to buf */
+};
+
+/*
+ * mmap layout: page offset 0 is this control page (map it read-only), the ring data pages
+ * follow from page offset SCULL_P_MMAP_DATA_PGOFF, size bytes, byte i of the stream at
+ * index i & (size - 1). The kernel keeps head/tail here up to date; userspace never
+ * writes them, it hands its progress back with SCULL_P_IOCTTAIL / SCULL_P_IOCTHEAD.
+ * poll() readiness is computed from these, so a consumer hands back what it read
+ * before it sleeps in poll(); in between it only needs to look at writer_waits.
+ */
+struct scull_p_mmap_ctl {
+    __u32 head;         /* next byte to write: load with acquire before reading the data */
+    __u32 tail;         /* next byte to read, as far as the kernel knows */
+    __u32 size;         /* ring bytes, a power of two; fixed while mapped */
+    __u32 packet;       /* 1 if the ring holds scull_p_rec_hdr framed records */
+    __u32 writer_waits; /* set while a writer is out of room: hand back space now.
+                         * Store the fence between consuming and reading this (seq_cst) */
+};
+#define SCULL_P_MMAP_DATA_PGOFF 1
+
+/* scull_pipe_ioctl.h - ioctls understood by /dev/scullpN (everything else but SCULL_IOCBATCH goes to scull_ioctl) */
+#define SCULL_P_IOC_MAGIC 'p'
+/* "Tell" a new ring size in bytes via arg value, like F_SETPIPE_SZ:
+ * rounded up to a power-of-two number of pages, returns the size actually used,
+ * -EBUSY if the bytes already queued would not fit */
+#define SCULL_P_IOCTSIZE _IO(SCULL_P_IOC_MAGIC, 0)
+/* "Query" the ring size in bytes via return value, like F_GETPIPE_SZ */
+#define SCULL_P_IOCQSIZE _IO(SCULL_P_IOC_MAGIC, 1)
+/* Wake thresholds in bytes, like SO_RCVLOWAT/SO_SNDLOWAT (0 means 1, capped at the ring size):
+ * a blocking read waits for min(RCVLOWAT, count) bytes (or EOF) and readers are otherwise
+ * only woken, polled readable or sent SIGIO once RCVLOWAT is queued; a blocking write waits for
+ * min(SNDLOWAT, count) bytes of room and writers are only woken once SNDLOWAT bytes are free */
+#define SCULL_P_IOCTRCVLOWAT _IO(SCULL_P_IOC_MAGIC, 2) /* "Tell" via arg value */
+#define SCULL_P_IOCQRCVLOWAT _IO(SCULL_P_IOC_MAGIC, 3) /* "Query" via return value */
+#define SCULL_P_IOCTSNDLOWAT _IO(SCULL_P_IOC_MAGIC, 4)
+#define SCULL_P_IOCQSNDLOWAT _IO(SCULL_P_IOC_MAGIC, 5)
+/* Packet mode (also selected by opening an idle pipe with O_DIRECT, like pipe2(O_DIRECT)):
+ * each write() is one record (all or nothing, -EMSGSIZE if it can never fit) and each
+ * read() returns one record, the part that does not fit the buffer is discarded.
+ * Switching needs an empty ring (-EBUSY otherwise); the mode stays with the pipe until switched back. */
+#define SCULL_P_IOCTPACKET _IO(SCULL_P_IOC_MAGIC, 6) /* "Tell" 0/1 via arg value */
+#define SCULL_P_IOCQPACKET _IO(SCULL_P_IOC_MAGIC, 7) /* "Query" via return value */
+/* Packet mode only: returns the number of records, blocks like read() for the first one,
+ * -EMSGSIZE if the first record is larger than buflen */
+#define SCULL_P_IOCRDBATCH _IOWR(SCULL_P_IOC_MAGIC, 8, struct scull_p_batch)
+/* Multi-queue mode: each writer file gets its own sub-ring (sized like the ring) and
+ * readers drain them round-robin, so producers do not contend with each other.
+ * Ordering holds per writer, not across writers. Switching needs no writer open and
+ * nothing queued (-EBUSY otherwise); splice is refused while it is on. */
+#define SCULL_P_IOCTMULTIQ _IO(SCULL_P_IOC_MAGIC, 9) /* "Tell" 0/1 via arg value */
+#define SCULL_P_IOCQMULTIQ _IO(SCULL_P_IOC_MAGIC, 10) /* "Query" via return value */
+/* Busy-poll budget in microseconds, like SO_BUSY_POLL: a blocking read that would sleep
+ * spins this long first, watching for data (0 = off, the default). Capped by the
+ * scull_p_max_busy_poll module parameter; "Tell" returns the value actually set */
+#define SCULL_P_IOCTBUSYPOLL _IO(SCULL_P_IOC_MAGIC, 11) /* "Tell" via arg value */
+#define SCULL_P_IOCQBUSYPOLL _IO(SCULL_P_IOC_MAGIC, 12) /* "Query" via return value */
+/* Latency accounting: stamp every write and, once it has been read in full, add its
+ * write-to-read time to a log2 histogram shown in /sys/kernel/debug/scull_pipe/pipeN.
+ * Turning it on clears the histogram */
+#define SCULL_P_IOCTTSTAMP _IO(SCULL_P_IOC_MAGIC, 13) /* "Tell" 0/1 via arg value */
+#define SCULL_P_IOCQTSTAMP _IO(SCULL_P_IOC_MAGIC, 14) /* "Query" via return value */
+/* mmap consumers: everything up to the index in arg has been read from the mapping,
+ * the space may be reused (-EINVAL if it is not between tail and head) */
+#define SCULL_P_IOCTTAIL _IO(SCULL_P_IOC_MAGIC, 15) /* "Tell" via arg value */
+/* mmap producers (needs a writable open): the data up to the index in arg has been
+ * stored through the mapping, publish it to readers (-EINVAL if it overruns tail) */
+#define SCULL_P_IOCTHEAD _IO(SCULL_P_IOC_MAGIC, 16) /* "Tell" via arg value */
+#define SCULL_P_IOC_MAXNR 16
+
+#endif /* _SCULL_PIPE_IOCTL_H */
@@ -0,0 +1,82 @@
+/*
+ * Tracepoints for scull_pipe, under events/scull_pipe/: what each read/write moved, and
+ * when readers and writers go to sleep and get woken. Free while disabled, so the fast
+ * path carries no logging at all.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull_pipe
+
+#if !defined(_SCULL_PIPE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_PIPE_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "scull_pipe.h"
+
+DECLARE_EVENT_CLASS(scull_p_rw,
+    TP_PROTO(struct scull_pipe *dev, size_t count, ssize_t ret),
+    TP_ARGS(dev, count, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->cdev.dev;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev=%d:%d count=%zu ret=%zd", MAJOR(__entry->devt), MINOR(__entry->devt),
+              __entry->count, __entry->ret)
+);
+DEFINE_EVENT(scull_p_rw, scull_p_read,
+    TP_PROTO(struct scull_pipe *dev, size_t count, ssize_t ret),
+    TP_ARGS(dev, count, ret)
+);
+DEFINE_EVENT(scull_p_rw, scull_p_write,
+    TP_PROTO(struct scull_pipe *dev, size_t count, ssize_t ret),
+    TP_ARGS(dev, count, ret)
+);
+
+/* a reader waiting for need queued bytes, or a writer for need bytes of room */
+TRACE_EVENT(scull_p_sleep,
+    TP_PROTO(struct scull_pipe *dev, bool writer, unsigned int need),
+    TP_ARGS(dev, writer, need),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(bool, writer)
+        __field(unsigned int, need)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->cdev.dev;
+        __entry->writer = writer;
+        __entry->need = need;
+    ),
+    TP_printk("dev=%d:%d %s need=%u", MAJOR(__entry->devt), MINOR(__entry->devt),
+              __entry->writer ? "writer" : "reader", __entry->need)
+);
+
+/* a wakeup sent to the readers' or the writers' queue, with its poll key */
+TRACE_EVENT(scull_p_wake,
+    TP_PROTO(struct scull_pipe *dev, bool writers, __poll_t key),
+    TP_ARGS(dev, writers, key),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(bool, writers)
+        __field(unsigned int, key)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->cdev.dev;
+        __entry->writers = writers;
+        __entry->key = (__force unsigned int)key;
+    ),
+    TP_printk("dev=%d:%d %s key=%#x", MAJOR(__entry->devt), MINOR(__entry->devt),
+              __entry->writers ? "writers" : "readers", __entry->key)
+);
+
+#endif /* _SCULL_PIPE_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_pipe_trace
+#include <trace/define_trace.h>
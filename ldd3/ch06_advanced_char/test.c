@@ -6,12 +6,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+/* mirror of SCULL_IOCTACCESS/QACCESS and enum scull_access_policy in common_scull/scull.h */
+#define SCULL_IOCTACCESS _IO('k', 13)
+#define SCULL_IOCQACCESS _IO('k', 14)
+static const char *policies[] = {"none", "single", "uid", "wuid", "priv", "proc", "open"};
+
 static const char *errname(int e){
     return strerror(e); // short and sweet; strerrname_np is GNU-only
 }
@@ -219,6 +225,52 @@ static void test_scullpriv(const char *dev){
     }
 }
 
+// packet mode (O_DIRECT): a zero-length read must leave the next record queued
+static void test_scullp_packet(const char *dev){
+    char buf[64];
+    ssize_t n;
+    int rfd, wfd;
+
+    fprintf(stderr, "\n=== TEST packet mode on %s ===\n", dev);
+    rfd = open_report(dev, O_RDONLY | O_NONBLOCK | O_DIRECT);
+    if (rfd < 0)
+        return;
+    wfd = open_report(dev, O_WRONLY | O_DIRECT);
+    if (wfd < 0) { close_report(rfd); return; }
+    must(write(wfd, "hello", 5) == 5, "write record");
+    n = read(rfd, buf, 0);
+    fprintf(stderr, "read(0) -> %zd %s\n", n, n < 0 ? errname(errno) : "OK");
+    n = read(rfd, buf, sizeof(buf));
+    if (n == 5 && !memcmp(buf, "hello", 5))
+        fprintf(stderr, "OK: record still there after a zero-length read.\n");
+    else
+        fprintf(stderr, "UNEXPECTED: read after read(0) -> %zd %s\n", n, n < 0 ? errname(errno) : "");
+    close_report(wfd);
+    close_report(rfd);
+}
+
+// attach an access policy to any scull minor, e.g. /dev/scull0, then run the tests on it
+static int attach_policy(const char *dev, const char *name){
+    int p, fd, r;
+    for (p = 0; p < (int)(sizeof(policies)/sizeof(policies[0])); p++)
+        if (!strcmp(name, policies[p]))
+            break;
+    if (p == (int)(sizeof(policies)/sizeof(policies[0]))) {
+        fprintf(stderr, "unknown policy %s\n", name);
+        return 2;
+    }
+    fd = open_report(dev, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    r = ioctl(fd, SCULL_IOCTACCESS, p);
+    fprintf(stderr, "ioctl(SCULL_IOCTACCESS, %s) -> %d %s\n", name, r, r ? errname(errno) : "OK");
+    r = ioctl(fd, SCULL_IOCQACCESS);
+    if (r >= 0 && r < (int)(sizeof(policies)/sizeof(policies[0])))
+        fprintf(stderr, "%s policy is now %s\n", dev, policies[r]);
+    close_report(fd);
+    return 0;
+}
+
 static void usage(const char *argv0){
     fprintf(stderr,
         "Usage:\n"
@@ -226,11 +278,13 @@ static void usage(const char *argv0){
         "  %s uid     <dev> [uid1 uid2]\n"
         "  %s wuid    <dev> [writer_uid other_uid]\n"
         "  %s priv    <dev>\n"
+        "  %s packet  <scullpN>\n"
+        "  %s attach  <dev> <none|single|uid|wuid|priv|proc|open>\n"
         "\n"
         "Notes:\n"
         "- Run as root if you want the tool to switch UIDs internally.\n"
         "- If UIDs omitted: uid1=geteuid(), uid2=uid1+1 (best-effort).\n",
-        argv0, argv0, argv0, argv0);
+        argv0, argv0, argv0, argv0, argv0, argv0);
 }
 
 int main(int argc, char **argv){
@@ -239,6 +293,9 @@ int main(int argc, char **argv){
     const char *mode = argv[1];
     const char *dev  = argv[2];
 
+    if (!strcmp(mode, "attach"))
+        return argc == 4 ? attach_policy(dev, argv[3]) : (usage(argv[0]), 2);
+
     uid_t uid1 = (argc >= 4) ? (uid_t)strtoul(argv[3], NULL, 10) : geteuid();
     uid_t uid2 = (argc >= 5) ? (uid_t)strtoul(argv[4], NULL, 10) : (uid1 + 1);
 
@@ -250,6 +307,8 @@ int main(int argc, char **argv){
         test_scullwuid(dev, uid1, uid2);
     } else if (!strcmp(mode, "priv")) {
         test_scullpriv(dev);
+    } else if (!strcmp(mode, "packet")) {
+        test_scullp_packet(dev);
     } else {
         usage(argv[0]);
         return 2;
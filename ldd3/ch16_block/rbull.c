@@ -4,7 +4,18 @@
 #include <linux/blkdev.h>
 #include <linux/moduleparam.h>
 #include <linux/types.h>
-#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/xarray.h>
+#include <linux/highmem.h>
+#include <linux/nodemask.h>
+#include <linux/hrtimer.h>
+#include <linux/prandom.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
+#include <linux/lockdep.h>
+#include <linux/percpu-rwsem.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("victor delaplaine");
@@ -23,14 +34,141 @@ static u16 nr_hw_queues = 4;
 module_param(nr_hw_queues, ushort, 0644);
 MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues");
 
+static u16 poll_queues = 1;
+module_param(poll_queues, ushort, 0444);
+MODULE_PARM_DESC(poll_queues, "Hardware queues for polled I/O (io_uring IOPOLL, RWF_HIPRI), on top of nr_hw_queues; 0 disables polling");
+
+static bool zoned = false;
+module_param(zoned, bool, 0444);
+MODULE_PARM_DESC(zoned, "Expose a host-managed zoned device (sequential write required zones)");
+
+static u32 zone_size_mb = 16;
+module_param(zone_size_mb, uint, 0444);
+MODULE_PARM_DESC(zone_size_mb, "Zone size in MiB (power of two); the disk is cut to whole zones");
+
+static u32 zone_nr_conv = 0;
+module_param(zone_nr_conv, uint, 0444);
+MODULE_PARM_DESC(zone_nr_conv, "Number of conventional (randomly writable) zones at the start of the disk");
+
+static u32 lat_read_us = 0;
+module_param(lat_read_us, uint, 0444);
+MODULE_PARM_DESC(lat_read_us, "Device model: base latency of a read (us)");
+
+static u32 lat_write_us = 0;
+module_param(lat_write_us, uint, 0444);
+MODULE_PARM_DESC(lat_write_us, "Device model: base latency of a write, flush or other non-read (us)");
+
+static u32 lat_jitter_us = 0;
+module_param(lat_jitter_us, uint, 0444);
+MODULE_PARM_DESC(lat_jitter_us, "Device model: uniform random extra latency in [0, lat_jitter_us] (us)");
+
+static u32 bw_read_mbps = 0;
+module_param(bw_read_mbps, uint, 0444);
+MODULE_PARM_DESC(bw_read_mbps, "Device model: read bandwidth cap in MiB/s (0: none)");
+
+static u32 bw_write_mbps = 0;
+module_param(bw_write_mbps, uint, 0444);
+MODULE_PARM_DESC(bw_write_mbps, "Device model: write bandwidth cap in MiB/s (0: none)");
+
+static u32 model_channels = 8;
+module_param(model_channels, uint, 0444);
+MODULE_PARM_DESC(model_channels, "Device model: channels serving requests in parallel");
+
+static u32 gc_every_mb = 0;
+module_param(gc_every_mb, uint, 0444);
+MODULE_PARM_DESC(gc_every_mb, "Device model: stall for garbage collection after every this many MiB written (0: never)");
+
+static u32 gc_stall_us = 0;
+module_param(gc_stall_us, uint, 0444);
+MODULE_PARM_DESC(gc_stall_us, "Device model: length of a garbage collection stall (us)");
+
+static u32 model_seed = 1;
+module_param(model_seed, uint, 0444);
+MODULE_PARM_DESC(model_seed, "Device model: seed of the latency jitter PRNG, the same seed gives the same sequence");
+
+static int home_node = NUMA_NO_NODE;
+module_param(home_node, int, 0444);
+MODULE_PARM_DESC(home_node, "NUMA node for the tag set and shared structures (-1: no preference)");
+
 static u32 queue_depth = 64;
 module_param(queue_depth, uint, 0644);
 MODULE_PARM_DESC(queue_depth, "Queue depth per hardware queue");
 
+static bool sync_io = true;
+module_param(sync_io, bool, 0444);
+MODULE_PARM_DESC(sync_io, "Copy small requests inline in queue_rq, when that needs no sleep, instead of on the hctx workqueue");
+
+static u32 sync_max_kb = 128;
+module_param(sync_max_kb, uint, 0644);
+MODULE_PARM_DESC(sync_max_kb, "Largest request (KiB) done inline when sync_io is set; bigger ones go to the workqueue");
+
+static u32 lock_region_kb = 256;
+module_param(lock_region_kb, uint, 0444);
+MODULE_PARM_DESC(lock_region_kb, "Bytes (KiB, power of two) of the disk covered by one range lock");
+
+static u32 lock_stripes = 64;
+module_param(lock_stripes, uint, 0444);
+MODULE_PARM_DESC(lock_stripes, "Number of range locks; regions share them round-robin");
+
+static u32 max_sectors_kb = 1024;
+module_param(max_sectors_kb, uint, 0444);
+MODULE_PARM_DESC(max_sectors_kb, "Largest request in KiB (max_hw_sectors)");
+
+static u16 max_segments = 256;
+module_param(max_segments, ushort, 0444);
+MODULE_PARM_DESC(max_segments, "Most bio_vec segments in one request");
+
+static bool rotational = false;
+module_param(rotational, bool, 0444);
+MODULE_PARM_DESC(rotational, "Advertise a rotational disk (default: non-rotational, like an SSD)");
+
+static bool write_cache = false;
+module_param(write_cache, bool, 0444);
+MODULE_PARM_DESC(write_cache, "Advertise a volatile write cache (FLUSH/FUA are sent to the driver)");
+
 struct rbull_hctx;
+/* request classes for the statistics, ZONE_APPEND counts as a write, WRITE_ZEROES as a discard */
+enum { RBULL_OP_READ, RBULL_OP_WRITE, RBULL_OP_FLUSH, RBULL_OP_DISCARD, RBULL_OP_OTHER, RBULL_OP_NR };
+#define RBULL_SIZE_NR 5 // request size classes, see rbull_size_class()
+#define RBULL_LAT_BUCKETS 40 // bucket b counts latencies in [2^(b-1), 2^b) ns, the last one everything above
+
+/* per-hctx counters, only ever added to, so no lock: readers sum them up */
+struct rbull_stats
+{
+	atomic64_t ops[RBULL_OP_NR];
+	atomic64_t bytes[RBULL_OP_NR];
+	atomic64_t errors; // requests ended with a status other than OK
+	atomic_t inflight; // started and not yet ended
+	atomic_t qd_max; // high-water mark of inflight
+	atomic64_t lat[RBULL_OP_NR][RBULL_SIZE_NR][RBULL_LAT_BUCKETS];
+};
+struct rbull_zone
+{
+	struct mutex lock; // write pointer and condition, held across a write into the zone
+	sector_t start;
+	sector_t len; // zone capacity is the whole zone
+	sector_t wp; // next sector a write must start at
+	enum blk_zone_type type;
+	enum blk_zone_cond cond;
+};
+struct rbull_model
+{
+	bool on; // any knob set
+	spinlock_t lock; // busy, written, rnd
+	ktime_t *busy; // per channel: when it is done with what it was given so far
+	unsigned int nr_channels;
+	u64 written; // bytes written since the last GC stall
+	struct rnd_state rnd;
+};
 struct rbull_dev{
 	/* Backing store stuff */
-	void *data; // backing store
+	/*
+	 * Sparse backing store, one page per PAGE_SIZE of disk, like brd: a page only exists once
+	 * something was written there, reads of a missing page see zeroes, and DISCARD/WRITE_ZEROES
+	 * give whole pages back. Pages are only added or removed under the write range lock.
+	 */
+	struct xarray pages;
+	atomic_long_t nr_pages; // pages allocated
 	u64 size_bytes;  // backing stores size
 	sector_t capacity_sectors; // backing store num of sectors
 	/* blk-mq objects */
@@ -41,21 +179,52 @@ struct rbull_dev{
 
 	/* block control plane */
 	int major;
-	struct rw_semaphore lock;
+	/*
+	 * Range locks: region r of the disk (lock_shift bytes each) is guarded by
+	 * locks[r % nr_locks]. Requests on disjoint regions run in parallel, overlapping
+	 * ones share a lock and keep the old one-at-a-time ordering.
+	 */
+	struct rw_semaphore *locks;
+	struct percpu_rw_semaphore all_locks; // read: some stripes are held; write: all of them
+	unsigned int nr_locks;
+	unsigned int lock_shift;
 	atomic_t open_count;
 	/* to make flushes possible */
 	atomic_t inflight_writes;
 	wait_queue_head_t flush_wq;
 	/* have a workqueue per hctx */
 	struct rbull_hctx **hctxs;
+	/* hctx 0..nr_queues-1 take interrupt-style I/O, the nr_poll_queues after them polled I/O */
+	unsigned int nr_queues;
+	unsigned int nr_poll_queues;
+	/* zoned mode only, zones is NULL otherwise */
+	struct rbull_zone *zones;
+	unsigned int nr_zones;
+	unsigned int zone_shift; // sectors per zone, log2
+	struct rbull_model model;
+	struct dentry *debugfs_stats, *debugfs_reset; // in the queue's debugfs dir, see rbull_stats_show()
 } r_dev;
 
 struct rbull_hctx
 {
 	struct rbull_dev *dev;
 	unsigned int idx;
-	/* per-hctx workqueue */
+	int node; // NUMA node of the CPUs mapped to this hctx, where its pages get allocated
+	/*
+	 * per-hctx workqueue, per-CPU (bound) rather than unbound: the one work item is queued
+	 * on a CPU of hctx->cpumask, so requests are copied on the socket that submitted them.
+	 * A work item never runs on two CPUs at once, which keeps the hctx serialized.
+	 */
 	struct workqueue_struct *wq;
+	/*
+	 * list: requests handed to work, one work item drains the whole list per kick;
+	 * polled: on a poll hctx, requests already copied and waiting for ->poll to end them
+	 */
+	spinlock_t lock;
+	struct list_head list;
+	struct list_head polled;
+	struct work_struct work;
+	struct rbull_stats stats;
 };
 static int rbull_open(struct gendisk *disk, blk_mode_t mode){
 	struct rbull_dev *dev = disk->private_data;
@@ -69,6 +238,8 @@ static void rbull_release(struct gendisk *disk)
 	atomic_dec(&dev->open_count);
 
 }
+static int rbull_report_zones(struct gendisk *disk, sector_t sector, unsigned int nr_zones,
+			      report_zones_cb cb, void *data);
 /*
  * The device operations structure.
  */
@@ -76,6 +247,7 @@ static struct block_device_operations rbull_fops = {
 	.owner           = THIS_MODULE,
 	.open 	         = rbull_open,
 	.release 	 = rbull_release,
+	.report_zones    = rbull_report_zones,
 };
 
 struct rbull_rq_ctx
@@ -86,7 +258,10 @@ struct rbull_rq_ctx
 	enum req_op op; // READ/WRITE/FLUSH
 	blk_status_t st; // status to complete with
 	struct rbull_hctx *rh;
-	struct work_struct work;
+	struct list_head node; // on rh->list while it waits for the worker, rh->polled for ->poll
+	struct hrtimer timer; // device model: ends the request at its due time
+	ktime_t due; // device model, poll queues: not reaped before this (0: any time)
+	u64 start_ns; // when it was started, for the latency histograms
 	/* atomic abort */
 	atomic_t abort;
 	atomic_t done;
@@ -95,76 +270,486 @@ struct rbull_rq_ctx
 
 
 
-static void rbull_rq_work(struct work_struct *work)
+/* stripe i is in the range: a..b, or 0..b and a..end when the range wraps past the last lock */
+static inline bool rbull_range_has(unsigned int i, unsigned int a, unsigned int b)
+{
+	return a <= b ? (i >= a && i <= b) : (i <= b || i >= a);
+}
+
+/* most stripes one request takes one by one; a wider range takes all_locks for writing instead */
+#define RBULL_RANGE_NEST 8 // MAX_LOCKDEP_SUBCLASSES: lockdep subclasses are 0..7
+
+/*
+ * Visit the locks covering [off, off + len) in ascending index order, the one order every
+ * request uses, so two requests taking several locks cannot deadlock. The stripes share
+ * one lockdep class; the n-th one taken is subclass n, which is why a request takes at
+ * most RBULL_RANGE_NEST of them, under all_locks for reading. A wider range (a big
+ * discard, a zone reset) takes all_locks for writing and no stripe at all.
+ */
+static void rbull_range_lock(struct rbull_dev *dev, u64 off, u64 len, bool write, bool lock)
+{
+	u64 first = off >> dev->lock_shift, last = (off + len - 1) >> dev->lock_shift;
+	unsigned int a = first % dev->nr_locks, b = last % dev->nr_locks, i, n = 0;
+
+	if (last - first + 1 > RBULL_RANGE_NEST)
+	{
+		if (lock) percpu_down_write(&dev->all_locks);
+		else      percpu_up_write(&dev->all_locks);
+		return;
+	}
+	if (last - first + 1 >= dev->nr_locks)
+	{
+		a = 0; // wraps all the way round: every lock
+		b = dev->nr_locks - 1;
+	}
+	if (lock)
+		percpu_down_read(&dev->all_locks);
+	for (i = 0; i < dev->nr_locks; i++)
+	{
+		if (!rbull_range_has(i, a, b))
+			continue;
+		if (lock)
+		{
+			if (write) down_write_nested(&dev->locks[i], n++);
+			else       down_read_nested(&dev->locks[i], n++);
+		}
+		else
+		{
+			if (write) up_write(&dev->locks[i]);
+			else       up_read(&dev->locks[i]);
+		}
+	}
+	if (!lock)
+		percpu_up_read(&dev->all_locks);
+}
+
+/*
+ * rbull_range_lock() for the inline paths, which must not sleep: all of the range or none
+ * of it, false if a lock is contended or the range is a wide one. Released with
+ * rbull_range_lock(..., false) as usual.
+ */
+static bool rbull_range_trylock(struct rbull_dev *dev, u64 off, u64 len, bool write)
+{
+	u64 first = off >> dev->lock_shift, last = (off + len - 1) >> dev->lock_shift;
+	unsigned int a = first % dev->nr_locks, b = last % dev->nr_locks, i, j;
+
+	if (last - first + 1 > RBULL_RANGE_NEST || !percpu_down_read_trylock(&dev->all_locks))
+		return false;
+	if (last - first + 1 >= dev->nr_locks)
+	{
+		a = 0;
+		b = dev->nr_locks - 1;
+	}
+	for (i = 0; i < dev->nr_locks; i++)
+	{
+		if (!rbull_range_has(i, a, b))
+			continue;
+		if (write ? down_write_trylock(&dev->locks[i]) : down_read_trylock(&dev->locks[i]))
+			continue;
+		for (j = 0; j < i; j++)
+		{
+			if (!rbull_range_has(j, a, b))
+				continue;
+			if (write) up_write(&dev->locks[j]);
+			else       up_read(&dev->locks[j]);
+		}
+		percpu_up_read(&dev->all_locks);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * the backing page holding byte off; with alloc, a zeroed one is added if there is none yet,
+ * on node (the writer's), so a page lives where the data was first written from
+ */
+static struct page *rbull_page(struct rbull_dev *dev, u64 off, bool alloc, int node, gfp_t gfp)
+{
+	pgoff_t idx = off >> PAGE_SHIFT;
+	struct page *page = xa_load(&dev->pages, idx), *cur;
+
+	if (page || !alloc)
+		return page;
+	page = alloc_pages_node(node, gfp | __GFP_ZERO | __GFP_HIGHMEM, 0);
+	if (!page)
+		return NULL;
+	cur = xa_cmpxchg(&dev->pages, idx, NULL, page, gfp);
+	if (cur)
+	{
+		__free_page(page);
+		return xa_is_err(cur) ? NULL : cur;
+	}
+	atomic_long_inc(&dev->nr_pages);
+	return page;
+}
+
+/* copy len bytes between buf and the store at off, page by page; false if a page could not be allocated */
+static bool rbull_copy(struct rbull_dev *dev, void *buf, u64 off, unsigned int len, bool write,
+		       int node, gfp_t gfp)
+{
+	while (len)
+	{
+		unsigned int poff = offset_in_page(off), n = min_t(unsigned int, len, PAGE_SIZE - poff);
+		struct page *page = rbull_page(dev, off, write, node, gfp);
+
+		if (write)
+		{
+			if (!page)
+				return false;
+			memcpy_to_page(page, poff, buf, n);
+		}
+		else if (page)
+			memcpy_from_page(buf, page, poff, n);
+		else
+			memset(buf, 0, n); // never written: reads as zeroes
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* the inline paths: every page a write will touch, allocated before any of it is copied */
+static bool rbull_prealloc(struct rbull_dev *dev, u64 off, u64 len, int node, gfp_t gfp)
+{
+	u64 end = off + len;
+
+	for (off = round_down(off, PAGE_SIZE); off < end; off += PAGE_SIZE)
+		if (!rbull_page(dev, off, true, node, gfp))
+			return false;
+	return true;
+}
+
+/* DISCARD/WRITE_ZEROES: free the pages wholly inside the range, zero the partial ones at the ends */
+static void rbull_zero_range(struct rbull_dev *dev, u64 off, u64 len)
+{
+	while (len)
+	{
+		unsigned int poff = offset_in_page(off), n = min_t(u64, len, PAGE_SIZE - poff);
+		struct page *page;
+
+		if (n == PAGE_SIZE)
+		{
+			page = xa_erase(&dev->pages, off >> PAGE_SHIFT);
+			if (page)
+			{
+				__free_page(page);
+				atomic_long_dec(&dev->nr_pages);
+			}
+		}
+		else if ((page = rbull_page(dev, off, false, NUMA_NO_NODE, 0)))
+			memzero_page(page, poff, n);
+		off += n;
+		len -= n;
+	}
+}
+
+static void rbull_free_pages(struct rbull_dev *dev)
+{
+	struct page *page;
+	unsigned long idx;
+
+	xa_for_each(&dev->pages, idx, page)
+		__free_page(page);
+	xa_destroy(&dev->pages);
+	atomic_long_set(&dev->nr_pages, 0);
+}
+
+/*
+ * Zoned mode: the disk is cut into nr_zones zones of zone_sectors each, the first
+ * zone_nr_conv conventional (written anywhere), the rest sequential write required.
+ * A sequential zone only takes writes at its write pointer and is reset as a whole.
+ * zone->lock is held from the write pointer check until the data is in, so a zone append
+ * gets its sector and its data in one step; it is taken before the range locks.
+ */
+static struct rbull_zone *rbull_zone_of(struct rbull_dev *dev, sector_t sector)
+{
+	return &dev->zones[sector >> dev->zone_shift];
+}
+
+static int rbull_init_zones(struct rbull_dev *dev)
+{
+	unsigned int i;
+
+	if (!zone_size_mb || !is_power_of_2(zone_size_mb))
+		return -EINVAL;
+	dev->zone_shift = ilog2(zone_size_mb) + 20 - SECTOR_SHIFT;
+	dev->nr_zones = dev->capacity_sectors >> dev->zone_shift;
+	if (!dev->nr_zones || zone_nr_conv >= dev->nr_zones)
+		return -EINVAL;
+	/* a partial last zone is dropped, the block layer wants equal zones */
+	dev->capacity_sectors = (sector_t)dev->nr_zones << dev->zone_shift;
+	dev->size_bytes = dev->capacity_sectors << SECTOR_SHIFT;
+
+	dev->zones = kvcalloc(dev->nr_zones, sizeof(*dev->zones), GFP_KERNEL);
+	if (!dev->zones)
+		return -ENOMEM;
+	for (i = 0; i < dev->nr_zones; i++)
+	{
+		struct rbull_zone *zone = &dev->zones[i];
+
+		mutex_init(&zone->lock);
+		zone->start = (sector_t)i << dev->zone_shift;
+		zone->len = 1ULL << dev->zone_shift;
+		if (i < zone_nr_conv)
+		{
+			zone->type = BLK_ZONE_TYPE_CONVENTIONAL;
+			zone->cond = BLK_ZONE_COND_NOT_WP;
+			zone->wp = zone->start + zone->len;
+		}
+		else
+		{
+			zone->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+			zone->cond = BLK_ZONE_COND_EMPTY;
+			zone->wp = zone->start;
+		}
+	}
+	return 0;
+}
+
+static int rbull_report_zones(struct gendisk *disk, sector_t sector, unsigned int nr_zones,
+			      report_zones_cb cb, void *data)
+{
+	struct rbull_dev *dev = disk->private_data;
+	unsigned int first, i;
+	struct blk_zone blkz;
+	int ret;
+
+	if (!dev->zones)
+		return -EOPNOTSUPP;
+	first = sector >> dev->zone_shift;
+	if (first >= dev->nr_zones)
+		return 0;
+	nr_zones = min(nr_zones, dev->nr_zones - first);
+	for (i = 0; i < nr_zones; i++)
+	{
+		struct rbull_zone *zone = &dev->zones[first + i];
+
+		memset(&blkz, 0, sizeof(blkz));
+		mutex_lock(&zone->lock);
+		blkz.start = zone->start;
+		blkz.len = zone->len;
+		blkz.capacity = zone->len;
+		blkz.wp = zone->wp;
+		blkz.type = zone->type;
+		blkz.cond = zone->cond;
+		mutex_unlock(&zone->lock);
+		ret = cb(&blkz, first + i, data);
+		if (ret)
+			return ret;
+	}
+	return nr_zones;
+}
+
+/* back to empty: drop the zone's pages, so it reads as zeroes again */
+static void rbull_zone_reset(struct rbull_dev *dev, struct rbull_zone *zone)
+{
+	if (zone->wp != zone->start)
+	{
+		rbull_range_lock(dev, zone->start << SECTOR_SHIFT, zone->len << SECTOR_SHIFT, true, true);
+		rbull_zero_range(dev, zone->start << SECTOR_SHIFT, zone->len << SECTOR_SHIFT);
+		rbull_range_lock(dev, zone->start << SECTOR_SHIFT, zone->len << SECTOR_SHIFT, true, false);
+	}
+	zone->wp = zone->start;
+	zone->cond = BLK_ZONE_COND_EMPTY;
+}
+
+/* REQ_OP_ZONE_{RESET,RESET_ALL,OPEN,CLOSE,FINISH} */
+static blk_status_t rbull_zone_mgmt(struct rbull_dev *dev, enum req_op op, sector_t sector)
+{
+	struct rbull_zone *zone;
+	blk_status_t ret = BLK_STS_OK;
+	unsigned int i;
+
+	if (op == REQ_OP_ZONE_RESET_ALL)
+	{
+		for (i = zone_nr_conv; i < dev->nr_zones; i++)
+		{
+			zone = &dev->zones[i];
+			mutex_lock(&zone->lock);
+			rbull_zone_reset(dev, zone);
+			mutex_unlock(&zone->lock);
+		}
+		return BLK_STS_OK;
+	}
+	if (sector >= dev->capacity_sectors)
+		return BLK_STS_IOERR;
+	zone = rbull_zone_of(dev, sector);
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return BLK_STS_IOERR;
+
+	mutex_lock(&zone->lock);
+	switch (op)
+	{
+	case REQ_OP_ZONE_RESET:
+		rbull_zone_reset(dev, zone);
+		break;
+	case REQ_OP_ZONE_OPEN:
+		if (zone->cond == BLK_ZONE_COND_FULL)
+			ret = BLK_STS_IOERR;
+		else
+			zone->cond = BLK_ZONE_COND_EXP_OPEN;
+		break;
+	case REQ_OP_ZONE_CLOSE:
+		if (zone->cond == BLK_ZONE_COND_FULL)
+			ret = BLK_STS_IOERR;
+		else if (zone->cond == BLK_ZONE_COND_IMP_OPEN || zone->cond == BLK_ZONE_COND_EXP_OPEN)
+			zone->cond = zone->wp == zone->start ? BLK_ZONE_COND_EMPTY : BLK_ZONE_COND_CLOSED;
+		break;
+	case REQ_OP_ZONE_FINISH:
+		zone->wp = zone->start + zone->len;
+		zone->cond = BLK_ZONE_COND_FULL;
+		break;
+	default:
+		ret = BLK_STS_NOTSUPP;
+		break;
+	}
+	mutex_unlock(&zone->lock);
+	return ret;
+}
+
+/*
+ * Before a WRITE or ZONE_APPEND: check it against the write pointer, and for an append
+ * pick its sector (the write pointer, reported back through rq->__sector). Returns with
+ * *zonep locked for rbull_zone_write_end() when the zone is sequential, else *zonep NULL.
+ */
+static blk_status_t rbull_zone_write_begin(struct rbull_dev *dev, struct request *rq,
+					   struct rbull_zone **zonep)
+{
+	sector_t sector = blk_rq_pos(rq), nr = blk_rq_sectors(rq);
+	struct rbull_zone *zone;
+
+	*zonep = NULL;
+	if (sector >= dev->capacity_sectors)
+		return BLK_STS_IOERR;
+	zone = rbull_zone_of(dev, sector);
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return req_op(rq) == REQ_OP_ZONE_APPEND ? BLK_STS_IOERR : BLK_STS_OK;
+
+	mutex_lock(&zone->lock);
+	if (req_op(rq) == REQ_OP_ZONE_APPEND)
+	{
+		sector = zone->wp;
+		rq->__sector = sector;
+	}
+	if (zone->cond == BLK_ZONE_COND_FULL || sector != zone->wp ||
+	    sector + nr > zone->start + zone->len)
+	{
+		mutex_unlock(&zone->lock);
+		return BLK_STS_IOERR;
+	}
+	*zonep = zone;
+	return BLK_STS_OK;
+}
+
+/* the data is in (or not, ret): move the write pointer and let the next writer in */
+static void rbull_zone_write_end(struct rbull_zone *zone, sector_t nr, blk_status_t ret)
+{
+	if (ret == BLK_STS_OK)
+	{
+		zone->wp += nr;
+		if (zone->wp == zone->start + zone->len)
+			zone->cond = BLK_ZONE_COND_FULL;
+		else if (zone->cond != BLK_ZONE_COND_EXP_OPEN)
+			zone->cond = BLK_ZONE_COND_IMP_OPEN;
+	}
+	mutex_unlock(&zone->lock);
+}
+
+/*
+ * Copy a request between its bio_vecs and the backing store. May sleep (range locks, flush
+ * wait, zone lock, page allocation) unless nowait: then whatever would sleep is not
+ * started, and BLK_STS_AGAIN says the request is untouched and has to go to the worker.
+ */
+static blk_status_t rbull_do_rq(struct rbull_rq_ctx *ctx, bool nowait)
 {
-	struct rbull_rq_ctx *ctx = container_of(work, struct rbull_rq_ctx, work);
 	struct request *rq = ctx->rq;
 	struct rbull_dev *dev = ctx->dev;
-	struct rbull_hctx *rh = ctx->rh;
 	sector_t start = blk_rq_pos(rq); // start sector
 	blk_status_t ret = BLK_STS_OK;
 
 	struct bio_vec bvec;
 	struct req_iterator iter;
 	size_t dev_off = start << SECTOR_SHIFT;
+	struct rbull_zone *zone = NULL;
 
 	bool is_flush = (ctx->op == REQ_OP_FLUSH);
 	bool is_write = op_is_write(ctx->op)  || ctx->op == REQ_OP_DISCARD || ctx->op == REQ_OP_WRITE_ZEROES;
+	bool data_write = ctx->op == REQ_OP_WRITE || ctx->op == REQ_OP_ZONE_APPEND;
+	gfp_t gfp = nowait ? GFP_NOWAIT : GFP_NOIO; // NOIO: we may be backing swap or a filesystem
 	if (is_flush)
 	{
+		if (nowait)
+			return atomic_read(&dev->inflight_writes) ? BLK_STS_AGAIN : BLK_STS_OK;
 		wait_event(dev->flush_wq, atomic_read(&dev->inflight_writes) == 0);
-		goto out_end;
+		return BLK_STS_OK;
 
 	}
+	/* zone management and zoned writes take the zone mutex */
+	if (nowait && dev->zones && (op_is_zone_mgmt(ctx->op) || data_write))
+		return BLK_STS_AGAIN;
+	if (dev->zones)
+	{
+		/* zone management carries no data, writes must land on the write pointer */
+		if (op_is_zone_mgmt(ctx->op))
+			return rbull_zone_mgmt(dev, ctx->op, start);
+		if (ctx->op == REQ_OP_WRITE || ctx->op == REQ_OP_ZONE_APPEND)
+		{
+			ret = rbull_zone_write_begin(dev, rq, &zone);
+			if (ret != BLK_STS_OK)
+				return ret;
+			start = blk_rq_pos(rq); // an append was just given its sector
+			dev_off = start << SECTOR_SHIFT;
+		}
+	}
+	if (!blk_rq_bytes(rq))
+		goto out;
+	if (dev_off + blk_rq_bytes(rq) > dev->size_bytes)
+	{
+		ret = BLK_STS_IOERR;
+		goto out;
+	}
+	/* the whole range at once: a request is never seen half written by an overlapping one */
+	if (!nowait)
+		rbull_range_lock(dev, dev_off, blk_rq_bytes(rq), is_write, true);
+	else if (!rbull_range_trylock(dev, dev_off, blk_rq_bytes(rq), is_write))
+		return BLK_STS_AGAIN;
+	else if (data_write && !rbull_prealloc(dev, dev_off, blk_rq_bytes(rq), ctx->rh->node, gfp))
+	{
+		/* the copy must not stop half way for want of a page: none of it is done yet */
+		rbull_range_lock(dev, dev_off, blk_rq_bytes(rq), is_write, false);
+		return BLK_STS_AGAIN;
+	}
+	/* counted once per request, so a flush waits for the whole request, not one segment */
+	if (is_write)
+		atomic_inc(&dev->inflight_writes);
 
-
-
-
-	rq_for_each_segment(bvec, rq, iter)
+	/* no payload to walk: the range is all there is */
+	if (ctx->op == REQ_OP_DISCARD || ctx->op == REQ_OP_WRITE_ZEROES)
+		rbull_zero_range(dev, dev_off, blk_rq_bytes(rq));
+	else rq_for_each_segment(bvec, rq, iter)
 	{
 		unsigned long offset = bvec.bv_offset;
 		unsigned int bytes = bvec.bv_len;
-		void *buf = kmap_local_page(bvec.bv_page);
-
-		if (dev->size_bytes < dev_off + bytes)
-		{
-			ret = BLK_STS_IOERR;
-			kunmap_local(buf);
-			goto out_end;
-		}
-		if (is_write)
-		{
-			atomic_inc(&dev->inflight_writes);
-			down_write(&dev->lock);
-		}else
-		{
-			down_read(&dev->lock);
-		}
+		void *buf;
 
 		/* Abort early if timeout happened */
 		if (atomic_read(&ctx->abort))
 		{
-			kunmap_local(buf);
-			goto abort;
+			ret = BLK_STS_TIMEOUT;
+			break;
 		}
 
-
-		// here i want to check the direction so i can do direction and then call down write or down read if req_ctx->req
+		buf = kmap_local_page(bvec.bv_page);
 		switch (ctx->op)
 		{
 		case REQ_OP_READ:
-			memcpy(buf + offset, dev->data + dev_off, bytes);
+			rbull_copy(dev, buf + offset, dev_off, bytes, false, ctx->rh->node, gfp);
 			break;
 		case REQ_OP_WRITE:
-			memcpy(dev->data + dev_off, buf + offset, bytes);
-			break;
-		case REQ_OP_DISCARD:
-		case REQ_OP_WRITE_ZEROES:
-			memset(dev->data + dev_off, 0, bytes);
-			break;
-		case REQ_OP_FLUSH:
-			wait_event(dev->flush_wq, atomic_read(&dev->inflight_writes) == 0);
-			ret = BLK_STS_OK;
+		case REQ_OP_ZONE_APPEND:
+			if (!rbull_copy(dev, buf + offset, dev_off, bytes, true, ctx->rh->node, gfp))
+				ret = BLK_STS_NOSPC; // no memory for a new page: a thin disk out of space
 			break;
 		default:
 			ret = BLK_STS_IOERR;
@@ -172,12 +757,11 @@ static void rbull_rq_work(struct work_struct *work)
 		}
 		dev_off += bytes;
 		kunmap_local(buf);
-		if (is_write) up_write(&dev->lock);
-		else          up_read(&dev->lock);
 
 		if (ret != BLK_STS_OK) break;
 
 	}
+	rbull_range_lock(dev, blk_rq_pos(rq) << SECTOR_SHIFT, blk_rq_bytes(rq), is_write, false);
 
 	if (is_write){
 		if (atomic_dec_and_test(&dev->inflight_writes))
@@ -185,15 +769,224 @@ static void rbull_rq_work(struct work_struct *work)
 			wake_up_all(&dev->flush_wq);
 		}
 	}
+out:
+	if (zone)
+		rbull_zone_write_end(zone, blk_rq_sectors(rq), ret);
+	return ret;
+}
+
+/*
+ * Device model: when any lat_ or bw_ knob is set, a request whose data is already copied is
+ * not ended at once but at the time the modelled device would have finished it, by an
+ * hrtimer (or, on a poll queue, by the first ->poll after that time). The device has
+ * model_channels channels working in parallel and the disk is striped across them a page at
+ * a time. A request is split over the channels its pages stripe to, each part waits behind
+ * the work already on its channel, and the request is done when its last part is; each
+ * channel moves 1/model_channels of the bandwidth, so a big request gets all of it. Anything
+ * but a read (writes, flushes, zone ops) takes lat_write_us. Every gc_every_mb of writes all
+ * channels stall gc_stall_us.
+ * Jitter comes from a PRNG seeded with model_seed, so a run can be repeated.
+ */
+static ktime_t rbull_model_due(struct rbull_rq_ctx *ctx)
+{
+	struct rbull_model *m = &ctx->dev->model;
+	struct request *rq = ctx->rq;
+	bool write = op_is_write(ctx->op); // picks the bandwidth and feeds GC
+	bool data = ctx->op == REQ_OP_READ || ctx->op == REQ_OP_WRITE || ctx->op == REQ_OP_ZONE_APPEND;
+	u64 bytes = data ? blk_rq_bytes(rq) : 0;
+	u32 mbps = write ? bw_write_mbps : bw_read_mbps;
+	u64 ns = (u64)(ctx->op != REQ_OP_READ ? lat_write_us : lat_read_us) * NSEC_PER_USEC;
+	u64 first = blk_rq_pos(rq) >> (PAGE_SHIFT - SECTOR_SHIFT);
+	u64 pages = bytes ? ((blk_rq_pos(rq) << SECTOR_SHIFT) + bytes - 1) / PAGE_SIZE - first + 1 : 1;
+	unsigned int spans = min_t(u64, pages, m->nr_channels);
+	unsigned int ch0, ch, i;
+	ktime_t now = ktime_get(), due = now, end;
+	u64 part;
+	u32 rem;
+
+	if (!m->on)
+		return 0;
+	ch0 = do_div(first, m->nr_channels);
+	rem = do_div(pages, m->nr_channels); // pages: now the stripes every spanned channel gets
+
+	spin_lock(&m->lock);
+	if (lat_jitter_us)
+		ns += ((u64)prandom_u32_state(&m->rnd) * (lat_jitter_us * NSEC_PER_USEC + 1)) >> 32;
+	for (i = 0; i < spans; i++)
+	{
+		/* the first rem channels from ch0 get one stripe more; bytes split in proportion */
+		ch = (ch0 + i) % m->nr_channels;
+		part = ns;
+		if (mbps && bytes)
+			part += mul_u64_u64_div_u64(bytes * (pages + (i < rem)), NSEC_PER_SEC * m->nr_channels,
+						    (pages * m->nr_channels + rem) * ((u64)mbps << 20));
+		end = ktime_add_ns(ktime_after(m->busy[ch], now) ? m->busy[ch] : now, part);
+		m->busy[ch] = end;
+		if (ktime_after(end, due))
+			due = end;
+	}
+	if (write && bytes && gc_every_mb)
+	{
+		m->written += bytes;
+		if (m->written >= (u64)gc_every_mb << 20)
+		{
+			/* garbage collection: every channel is busy for a while after its current work */
+			m->written = 0;
+			for (i = 0; i < m->nr_channels; i++)
+				m->busy[i] = ktime_add_us(ktime_after(m->busy[i], now) ? m->busy[i] : now,
+							  gc_stall_us);
+		}
+	}
+	spin_unlock(&m->lock);
+	return due;
+}
+
+static int rbull_model_init(struct rbull_dev *dev)
+{
+	struct rbull_model *m = &dev->model;
+
+	m->on = lat_read_us || lat_write_us || lat_jitter_us || bw_read_mbps || bw_write_mbps ||
+		(gc_every_mb && gc_stall_us);
+	if (!m->on)
+		return 0;
+	if (!model_channels)
+		return -EINVAL;
+	m->nr_channels = model_channels;
+	m->busy = kcalloc_node(m->nr_channels, sizeof(*m->busy), GFP_KERNEL, home_node);
+	if (!m->busy)
+		return -ENOMEM;
+	spin_lock_init(&m->lock);
+	prandom_seed_state(&m->rnd, model_seed);
+	return 0;
+}
+
+static unsigned int rbull_op_class(enum req_op op)
+{
+	switch (op)
+	{
+	case REQ_OP_READ:
+		return RBULL_OP_READ;
+	case REQ_OP_WRITE:
+	case REQ_OP_ZONE_APPEND:
+		return RBULL_OP_WRITE;
+	case REQ_OP_FLUSH:
+		return RBULL_OP_FLUSH;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		return RBULL_OP_DISCARD;
+	default:
+		return RBULL_OP_OTHER;
+	}
+}
 
-	out_end:
+/* <=4k, <=16k, <=64k, <=256k, bigger */
+static unsigned int rbull_size_class(unsigned int bytes)
+{
+	if (bytes <= SZ_4K)
+		return 0;
+	return min_t(unsigned int, RBULL_SIZE_NR - 1, (ilog2(bytes - 1) - 12) / 2 + 1);
+}
+
+/* rq was just started on rh */
+static void rbull_stat_start(struct rbull_hctx *rh, struct rbull_rq_ctx *ctx)
+{
+	struct rbull_stats *s = &rh->stats;
+	int depth = atomic_inc_return(&s->inflight), max = atomic_read(&s->qd_max);
+
+	ctx->start_ns = ktime_get_ns();
+	while (depth > max && !atomic_try_cmpxchg(&s->qd_max, &max, depth))
+		;
+}
+
+/* rq ends with st; called once, by whoever won ctx->done, before rq is handed back */
+static void rbull_stat_end(struct rbull_rq_ctx *ctx, blk_status_t st)
+{
+	struct rbull_stats *s = &ctx->rh->stats;
+	unsigned int op = rbull_op_class(ctx->op), bytes = blk_rq_bytes(ctx->rq);
+	u64 ns = ktime_get_ns() - ctx->start_ns;
+	unsigned int b = ns ? min_t(unsigned int, fls64(ns), RBULL_LAT_BUCKETS - 1) : 0;
+
+	atomic_dec(&s->inflight);
+	atomic64_inc(&s->ops[op]);
+	atomic64_add(bytes, &s->bytes[op]);
+	if (st != BLK_STS_OK)
+		atomic64_inc(&s->errors);
+	atomic64_inc(&s->lat[op][rbull_size_class(bytes)][b]);
+}
+
+/*
+ * end rq unless the timeout handler already did; with a batch, the end is deferred to
+ * one blk_mq_end_request_batch() for every request collected in it
+ */
+static void rbull_end(struct rbull_rq_ctx *ctx, blk_status_t st, struct io_comp_batch *iob)
+{
 	if (atomic_cmpxchg(&ctx->done, 0, 1) == 0)
 	{
-		blk_mq_end_request(rq, ret);
+		rbull_stat_end(ctx, st);
+		if (!blk_mq_add_to_batch(ctx->rq, iob, st != BLK_STS_OK, blk_mq_end_request_batch))
+			blk_mq_end_request(ctx->rq, st);
 	}
-	abort:
+}
+
+static enum hrtimer_restart rbull_model_timer(struct hrtimer *timer)
+{
+	struct rbull_rq_ctx *ctx = container_of(timer, struct rbull_rq_ctx, timer);
+
+	rbull_end(ctx, ctx->st, NULL);
+	return HRTIMER_NORESTART;
+}
 
+/* the copy is done: end rq now, or when the device model says it would be done */
+static void rbull_complete(struct rbull_rq_ctx *ctx, blk_status_t st, struct io_comp_batch *iob)
+{
+	ktime_t due = rbull_model_due(ctx);
 
+	if (due)
+	{
+		/* timed out meanwhile: rbull_timeout ended rq, there is nothing left to arm */
+		if (atomic_read(&ctx->abort))
+			return;
+		ctx->st = st;
+		hrtimer_start(&ctx->timer, due, HRTIMER_MODE_ABS);
+		/*
+		 * the timeout may have cancelled the timer just before we armed it: take it back
+		 * then. Pairs with the barrier between setting abort and cancelling in rbull_timeout.
+		 */
+		smp_mb();
+		if (atomic_read(&ctx->abort))
+			hrtimer_try_to_cancel(&ctx->timer);
+		return;
+	}
+	rbull_end(ctx, st, iob);
+}
+
+/* oldest request on list (rh->list or rh->polled), unlinked, or NULL; NULL too if it is not due by now */
+static struct rbull_rq_ctx *rbull_pop(struct rbull_hctx *rh, struct list_head *list, ktime_t now)
+{
+	struct rbull_rq_ctx *ctx;
+
+	/* one at a time under the lock, so the timeout handler never races a half-walked list */
+	spin_lock(&rh->lock);
+	ctx = list_first_entry_or_null(list, struct rbull_rq_ctx, node);
+	if (ctx && ktime_after(ctx->due, now))
+		ctx = NULL;
+	if (ctx)
+		list_del_init(&ctx->node);
+	spin_unlock(&rh->lock);
+	return ctx;
+}
+
+/* the hctx worker: run everything queued since the last kick, end it all as one batch */
+static void rbull_hctx_work(struct work_struct *work)
+{
+	struct rbull_hctx *rh = container_of(work, struct rbull_hctx, work);
+	DEFINE_IO_COMP_BATCH(iob);
+	struct rbull_rq_ctx *ctx;
+
+	while ((ctx = rbull_pop(rh, &rh->list, KTIME_MAX)))
+		rbull_complete(ctx, rbull_do_rq(ctx, false), &iob);
+	if (iob.complete)
+		iob.complete(&iob);
 }
 static enum blk_eh_timer_return rbull_timeout(struct request *rq)
 {
@@ -201,8 +994,16 @@ static enum blk_eh_timer_return rbull_timeout(struct request *rq)
 	struct rbull_dev *dev = ctx->dev;
 	struct rbull_hctx *rh = ctx->rh;
 	atomic_set(&ctx->abort, 1);
+	smp_mb__after_atomic(); // abort before the cancel; pairs with rbull_complete()
+	/* nor may a model timer end it later, when the tag may already be reused */
+	hrtimer_cancel(&ctx->timer);
+	/* the request may still wait on the worker or poll list: take it off before ending it */
+	spin_lock(&rh->lock);
+	list_del_init(&ctx->node);
+	spin_unlock(&rh->lock);
 	if (atomic_cmpxchg(&ctx->done, 0, 1) == 0)
 	{
+		rbull_stat_end(ctx, BLK_STS_TIMEOUT);
 		blk_mq_end_request(rq, BLK_STS_TIMEOUT);
 		printk(KERN_WARNING "rbull: timeout on request %llu on hw qid %d\n", rq->tag, rq->mq_hctx->queue_num);
 	}
@@ -218,30 +1019,38 @@ static int rbull_init_request(struct blk_mq_tag_set *set, struct request *rq,
 	memset(ctx, 0, sizeof(*ctx));
 	ctx->dev = set->driver_data;          // set this in init: tag_set.driver_data = dev
 	ctx->rh = ctx->dev->hctxs[hctx_idx];
-	INIT_WORK(&ctx->work, rbull_rq_work); // bind worker function
+	INIT_LIST_HEAD(&ctx->node);
+	hrtimer_setup(&ctx->timer, rbull_model_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 	atomic_set(&ctx->done, 0);
 	atomic_set(&ctx->abort, 0);
 	return 0;
 }
-static void rbull_exit_request(struct blk_mq_tag_set *set,
-							   struct request *rq,
-							   unsigned int hctx_idx)
-{
-	struct rbull_rq_ctx *ctx = blk_mq_rq_to_pdu(rq);
-	cancel_work_sync(&ctx->work);
-}
 
 static int rbull_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int idx)
 {
 	struct rbull_dev *dev = data;
-	struct rbull_hctx *rh = kzalloc(sizeof(*rh), GFP_KERNEL);
+	/* hctx->numa_node is the node of the CPUs blk-mq mapped to this hctx */
+	struct rbull_hctx *rh = kzalloc_node(sizeof(*rh), GFP_KERNEL, hctx->numa_node);
+	if (!rh)
+		return -ENOMEM;
 	rh->dev = dev;
 	rh->idx = idx;
-	rh->wq = alloc_ordered_workqueue("rbull_hctx%u", 0, idx); // workqueue that is 1-1 serialized
+	rh->node = hctx->numa_node;
+	// bound, one active item per CPU, usable under memory pressure (we may back swap)
+	rh->wq = alloc_workqueue("rbull_hctx%u", WQ_MEM_RECLAIM, 1, idx);
+	if (!rh->wq)
+	{
+		kfree(rh);
+		return -ENOMEM;
+	}
+	INIT_WORK(&rh->work, rbull_hctx_work);
+	spin_lock_init(&rh->lock);
+	INIT_LIST_HEAD(&rh->list);
+	INIT_LIST_HEAD(&rh->polled);
 	hctx->driver_data = rh;
 	dev->hctxs[idx] = rh;
 
-	return rh->wq ? 0 : -ENOMEM;
+	return 0;
 }
 static void rbull_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int idx)
 {
@@ -250,15 +1059,96 @@ static void rbull_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int idx)
 	destroy_workqueue(rh->wq);
 	kfree(rh);
 }
-static blk_status_t rbull_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bdq)
+
+/*
+ * start the worker on whatever was queued for it: on this CPU when it belongs to the hctx
+ * (the usual case, blk-mq picked the hctx by submitting CPU), else on one that does
+ */
+static void rbull_kick(struct blk_mq_hw_ctx *hctx)
+{
+	struct rbull_hctx *rh = hctx->driver_data;
+	unsigned int cpu = raw_smp_processor_id(); // only a placement hint, preemption is harmless
+
+	if (!cpumask_test_cpu(cpu, hctx->cpumask))
+		cpu = cpumask_first_and(hctx->cpumask, cpu_online_mask);
+	if (cpu < nr_cpu_ids)
+		queue_work_on(cpu, rh->wq, &rh->work);
+	else
+		queue_work(rh->wq, &rh->work);
+}
+
+/*
+ * Start rq and run it or hand it on. Returns true if it was queued for the hctx worker,
+ * which the caller kicks once for the whole batch (rbull_kick).
+ */
+static bool rbull_submit(struct blk_mq_hw_ctx *hctx, struct request *rq, struct io_comp_batch *iob)
 {
-	struct request *rq = bdq->rq;
 	struct rbull_dev *dev = rq->q->queuedata;
-	sector_t start = blk_rq_pos(rq); // start sector
-	blk_status_t ret = BLK_STS_OK;
 	struct rbull_rq_ctx *ctx = blk_mq_rq_to_pdu(rq);
+	struct rbull_hctx *rh = hctx->driver_data;
 
+	/* a model timer still pending from this tag's last request must not end this one */
+	hrtimer_cancel(&ctx->timer);
+	/* Fill in the ctx, for the inline path or the worker */
+	ctx->dev = dev;
+	ctx->rq = rq;
+	ctx->dev_off = blk_rq_pos(rq) << SECTOR_SHIFT;
+	ctx->op = req_op(rq);
+	ctx->st = BLK_STS_OK;
+	ctx->rh = rh;
+	ctx->due = 0;
+	atomic_set(&ctx->done, 0);
+	atomic_set(&ctx->abort, 0);
 	/* tell the blk-mq layer that the request is in flight */
+	blk_mq_start_request(rq);
+	rbull_stat_start(rh, ctx);
+	/*
+	 * Poll queue: no interrupt and no worker. Do the copy now and leave the request for
+	 * ->poll, which the submitter (io_uring IOPOLL, RWF_HIPRI) spins on to end it. Like the
+	 * inline path below it must not sleep: a request that would goes to the hctx worker,
+	 * which ends it the ordinary way while ->poll finds nothing.
+	 */
+	if (hctx->type == HCTX_TYPE_POLL)
+	{
+		blk_status_t st = rbull_do_rq(ctx, true);
+
+		if (st != BLK_STS_AGAIN)
+		{
+			ctx->st = st;
+			ctx->due = rbull_model_due(ctx);
+			spin_lock(&rh->lock);
+			list_add_tail(&ctx->node, &rh->polled);
+			spin_unlock(&rh->lock);
+			return false;
+		}
+	}
+	/*
+	 * A RAM disk copy costs less than the workqueue hop: do it right here and end the
+	 * request before returning. queue_rq must not sleep, so this only happens when the
+	 * range locks are free and the pages can be had at once; a contended request, a zoned
+	 * write or a flush with writes in flight goes to the workqueue instead, as do big
+	 * requests, so one of them does not hold up the submitter.
+	 */
+	else if (sync_io && blk_rq_bytes(rq) <= sync_max_kb * 1024)
+	{
+		blk_status_t st = rbull_do_rq(ctx, true);
+
+		if (st != BLK_STS_AGAIN)
+		{
+			rbull_complete(ctx, st, iob);
+			return false;
+		}
+	}
+	spin_lock(&rh->lock);
+	list_add_tail(&ctx->node, &rh->list);
+	spin_unlock(&rh->lock);
+	return true;
+}
+
+static blk_status_t rbull_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bdq)
+{
+	struct request *rq = bdq->rq;
+
 	if (blk_rq_is_passthrough(rq))
 	{
 		// dont support
@@ -266,30 +1156,201 @@ static blk_status_t rbull_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_
 		return BLK_STS_IOERR;
 
 	}
-	/* Fill in the ctx for dispatch async */
-	ctx->dev = dev;
-	ctx->rq = rq;
-	ctx->dev_off = start << SECTOR_SHIFT;;
-	ctx->op = req_op(rq);
-	ctx->st = BLK_STS_OK;
-	ctx->rh = hctx->driver_data;
-	atomic_set(&ctx->done, 0);
-	atomic_set(&ctx->abort, 0);
-	blk_mq_start_request(rq);
-	queue_work(ctx->rh->wq, &ctx->work);
+	/* more are coming unless this is the last one: blk-mq calls commit_rqs if they don't */
+	if (rbull_submit(hctx, rq, NULL) && bdq->last)
+		rbull_kick(hctx);
+	return BLK_STS_OK;
 
-	return ret;
+}
+
+/* a run of queue_rq calls stopped before the one marked last: kick the worker for what it queued */
+static void rbull_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+	rbull_kick(hctx);
+}
+
+/*
+ * A whole plug list in one call. Inline requests end as one batch at the end, the worker
+ * is kicked once per hctx instead of once per request. Nothing is left on rqlist,
+ * so blk-mq never falls back to queue_rq for this list.
+ */
+static void rbull_queue_rqs(struct rq_list *rqlist)
+{
+	DEFINE_IO_COMP_BATCH(iob);
+	struct blk_mq_hw_ctx *kick = NULL;
+	struct request *rq;
+
+	while ((rq = rq_list_pop(rqlist)))
+	{
+		struct blk_mq_hw_ctx *hctx = rq->mq_hctx;
 
+		if (blk_rq_is_passthrough(rq))
+		{
+			blk_mq_end_request(rq, BLK_STS_IOERR);
+			continue;
+		}
+		if (kick && kick != hctx)
+		{
+			rbull_kick(kick);
+			kick = NULL;
+		}
+		if (rbull_submit(hctx, rq, &iob))
+			kick = hctx;
+	}
+	if (kick)
+		rbull_kick(kick);
+	if (iob.complete)
+		iob.complete(&iob);
+}
+
+/*
+ * reap the requests queue_rq finished on this poll hctx, with the device model only those
+ * whose due time has passed; returns how many were ended
+ */
+static int rbull_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+{
+	struct rbull_hctx *rh = hctx->driver_data;
+	struct rbull_rq_ctx *ctx;
+	ktime_t now = ktime_get();
+	int nr = 0;
+
+	while ((ctx = rbull_pop(rh, &rh->polled, now)))
+	{
+		rbull_end(ctx, ctx->st, iob);
+		nr++;
+	}
+	return nr;
+}
+
+/* default map gets the first nr_queues hctxs, the poll map the ones after; no separate read map */
+static void rbull_map_queues(struct blk_mq_tag_set *set)
+{
+	struct rbull_dev *dev = set->driver_data;
+	unsigned int i, qoff = 0;
+
+	for (i = 0; i < set->nr_maps; i++)
+	{
+		struct blk_mq_queue_map *map = &set->map[i];
+
+		switch (i)
+		{
+		case HCTX_TYPE_DEFAULT:
+			map->nr_queues = dev->nr_queues;
+			break;
+		case HCTX_TYPE_POLL:
+			map->nr_queues = dev->nr_poll_queues;
+			break;
+		default:
+			map->nr_queues = 0;
+			continue;
+		}
+		map->queue_offset = qoff;
+		qoff += map->nr_queues;
+		blk_mq_map_queues(map);
+	}
 }
+
 struct blk_mq_ops rbull_mq_ops = {
 	.queue_rq =  rbull_queue_rq,
+	.queue_rqs = rbull_queue_rqs,
+	.commit_rqs = rbull_commit_rqs,
+	.poll = rbull_poll,
+	.map_queues = rbull_map_queues,
 	.init_request = rbull_init_request,
-	.exit_request = rbull_exit_request,
 	.init_hctx = rbull_init_hctx,
 	.exit_hctx = rbull_exit_hctx,
 	.timeout = rbull_timeout,
 };
 
+/*
+ * debugfs, next to blk-mq's own files in /sys/kernel/debug/block/<disk>/:
+ *   stats  per-hctx counters, then latency histograms (start to end, ns) per op and size,
+ *          summed over all hctxs
+ *   reset  write anything to zero everything but the in-flight counts
+ */
+static const char *const rbull_op_names[RBULL_OP_NR] = { "read", "write", "flush", "discard", "other" };
+static const char *const rbull_size_names[RBULL_SIZE_NR] = { "<=4k", "<=16k", "<=64k", "<=256k", ">256k" };
+
+static int rbull_stats_show(struct seq_file *m, void *v)
+{
+	struct rbull_dev *dev = m->private;
+	unsigned int nr = dev->nr_queues + dev->nr_poll_queues, i, op, sz, b;
+	u64 *hist, total;
+
+	seq_puts(m, "hctx type    ");
+	for (op = 0; op < RBULL_OP_NR; op++)
+		seq_printf(m, " %12s", rbull_op_names[op]);
+	seq_puts(m, "  bytes_read   bytes_write  inflight qd_max  errors\n");
+	for (i = 0; i < nr; i++)
+	{
+		struct rbull_stats *s = &dev->hctxs[i]->stats;
+
+		seq_printf(m, "%4u %-8s", i, i < dev->nr_queues ? "default" : "poll");
+		for (op = 0; op < RBULL_OP_NR; op++)
+			seq_printf(m, " %12lld", atomic64_read(&s->ops[op]));
+		seq_printf(m, " %12lld %12lld %9d %6d %7lld\n", atomic64_read(&s->bytes[RBULL_OP_READ]),
+			   atomic64_read(&s->bytes[RBULL_OP_WRITE]), atomic_read(&s->inflight),
+			   atomic_read(&s->qd_max), atomic64_read(&s->errors));
+	}
+
+	hist = kcalloc(RBULL_LAT_BUCKETS, sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+	for (op = 0; op < RBULL_OP_NR; op++)
+	{
+		for (sz = 0; sz < RBULL_SIZE_NR; sz++)
+		{
+			memset(hist, 0, RBULL_LAT_BUCKETS * sizeof(*hist));
+			total = 0;
+			for (i = 0; i < nr; i++)
+				for (b = 0; b < RBULL_LAT_BUCKETS; b++)
+					hist[b] += atomic64_read(&dev->hctxs[i]->stats.lat[op][sz][b]);
+			for (b = 0; b < RBULL_LAT_BUCKETS; b++)
+				total += hist[b];
+			if (!total)
+				continue;
+			seq_printf(m, "\nlatency %s %s: %llu requests\n", rbull_op_names[op], rbull_size_names[sz], total);
+			for (b = 0; b < RBULL_LAT_BUCKETS; b++)
+				if (hist[b])
+					seq_printf(m, "   %12llu - %-12llu %llu\n", b ? 1ULL << (b - 1) : 0ULL,
+						   b == RBULL_LAT_BUCKETS - 1 ? ~0ULL : (1ULL << b) - 1, hist[b]);
+		}
+	}
+	kfree(hist);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(rbull_stats);
+
+static ssize_t rbull_reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct rbull_dev *dev = file->private_data;
+	unsigned int nr = dev->nr_queues + dev->nr_poll_queues, i, op, sz, b;
+
+	for (i = 0; i < nr; i++)
+	{
+		struct rbull_stats *s = &dev->hctxs[i]->stats;
+
+		for (op = 0; op < RBULL_OP_NR; op++)
+		{
+			atomic64_set(&s->ops[op], 0);
+			atomic64_set(&s->bytes[op], 0);
+			for (sz = 0; sz < RBULL_SIZE_NR; sz++)
+				for (b = 0; b < RBULL_LAT_BUCKETS; b++)
+					atomic64_set(&s->lat[op][sz][b], 0);
+		}
+		atomic64_set(&s->errors, 0);
+		atomic_set(&s->qd_max, atomic_read(&s->inflight));
+	}
+	return count;
+}
+
+static const struct file_operations rbull_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = rbull_reset_write,
+	.llseek = noop_llseek,
+};
+
 static int setup_queue_limit(struct rbull_dev * dev)
 {
 	struct queue_limits *ql = &dev->qlimits;
@@ -299,22 +1360,47 @@ static int setup_queue_limit(struct rbull_dev * dev)
 	lba_sectors = sector_size >> SECTOR_SHIFT;
 	if (!lba_sectors) lba_sectors = 1;
 
-	blk_set_stacking_limits(ql); // set stacking limits
+	if (max_sectors_kb < PAGE_SIZE / 1024 || !max_segments) return -EINVAL;
+
+	/* fields left 0 get the block layer defaults (blk_validate_limits) */
 	memset(ql, 0, sizeof(*ql));
-	ql->features = 0;
-	// ql->features = (~BLK_FEAT_ZONED | ~BLK_FEAT_ROTATIONAL | ~BLK_FEAT_WRITE_CACHE | ~BLK_FEAT_FUA );
+	/* no seek penalty unless asked: the I/O scheduler and filesystems tune for that */
+	ql->features = rotational ? BLK_FEAT_ROTATIONAL : 0;
+	if (write_cache)
+		ql->features |= BLK_FEAT_WRITE_CACHE | BLK_FEAT_FUA;
 
 	/* sector and block size */
 	ql->logical_block_size = sector_size;
 	ql->physical_block_size = sector_size;
+	ql->io_min = sector_size;
+
+	/* request sizing: big sequential I/O should reach us as big requests, not 4 KiB pieces */
+	ql->max_hw_sectors = max_sectors_kb << 1;
+	ql->max_user_sectors = 0; // max_sectors follows max_hw_sectors, sysfs can lower it
+	ql->io_opt = max_sectors_kb << 10;
 
-	/* request sizing: max sectors*/
-	ql->max_hw_sectors = 8; // a request can only span 8 sectors
-	ql->max_sectors = 8; // must be less than or equal to hw
+	/* dma scatter-gather: noop, we copy page by page, so only the count matters */
+	ql->max_segments = max_segments;
+
+	if (dev->zones)
+	{
+		/*
+		 * host managed: requests never cross a zone, appends are done natively (no
+		 * emulation by the block layer), no limit on open or active zones. No
+		 * DISCARD/WRITE_ZEROES: they could not move a write pointer.
+		 */
+		ql->features |= BLK_FEAT_ZONED;
+		ql->chunk_sectors = 1U << dev->zone_shift;
+		ql->max_hw_zone_append_sectors = ql->max_hw_sectors;
+		ql->max_open_zones = 0;
+		ql->max_active_zones = 0;
+		return 0;
+	}
 
-	/* dma scatter-gather: noop */
-	ql->max_segments = 10;
-	ql->max_segment_size = PAGE_SIZE;
+	/* DISCARD and WRITE_ZEROES just clear the range, any size is fine */
+	ql->max_hw_discard_sectors = UINT_MAX >> SECTOR_SHIFT;
+	ql->discard_granularity = sector_size;
+	ql->max_write_zeroes_sectors = UINT_MAX >> SECTOR_SHIFT;
 	return 0;
 
 }
@@ -322,32 +1408,71 @@ static int __init rbull_init(void){
 	int ret;
 	/* Allocate & init backing memory */
 	struct rbull_dev *dev = &r_dev;
+	unsigned int i;
 	memset(dev, 0, sizeof(struct rbull_dev));
-	init_rwsem(&dev->lock);
+	if (home_node != NUMA_NO_NODE && (home_node < 0 || home_node >= nr_node_ids || !node_online(home_node)))
+		return -EINVAL;
+	if (!lock_stripes || lock_region_kb < 4 || !is_power_of_2(lock_region_kb))
+		return -EINVAL;
+	dev->nr_locks = lock_stripes;
+	dev->lock_shift = ilog2(lock_region_kb) + 10;
+	dev->locks = kcalloc_node(dev->nr_locks, sizeof(*dev->locks), GFP_KERNEL, home_node);
+	if (!dev->locks) return -ENOMEM;
+	for (i = 0; i < dev->nr_locks; i++)
+		init_rwsem(&dev->locks[i]);
+	if (percpu_init_rwsem(&dev->all_locks))
+	{
+		kfree(dev->locks);
+		return -ENOMEM;
+	}
+	ret = rbull_model_init(dev);
+	if (ret) goto free_locks;
 	atomic_set(&dev->open_count, 0);
 	atomic_set(&dev->inflight_writes, 0);
 	init_waitqueue_head(&dev->flush_wq);
 
 	dev->size_bytes = (u64)disk_sectors_mb * 1024 * 1024;
 	dev->capacity_sectors = dev->size_bytes >> SECTOR_SHIFT;
-	dev->hctxs = kzalloc(nr_hw_queues *sizeof(struct rbull_hctx *), GFP_KERNEL);
-	if (!dev->hctxs) return -ENOMEM;
+	dev->nr_queues = nr_hw_queues ? nr_hw_queues : 1;
+	dev->nr_poll_queues = poll_queues;
+	dev->hctxs = kcalloc_node(dev->nr_queues + dev->nr_poll_queues, sizeof(struct rbull_hctx *),
+				  GFP_KERNEL, home_node);
+	if (!dev->hctxs)
+	{
+		ret = -ENOMEM;
+		goto free_locks;
+	}
 
-	dev->data = vmalloc(dev->size_bytes);
-	if (!dev->data) goto free_hctx;
-	memset(dev->data, 0, dev->size_bytes);
+	if (zoned)
+	{
+		if (!IS_ENABLED(CONFIG_BLK_DEV_ZONED))
+		{
+			ret = -EOPNOTSUPP;
+			goto free_hctx;
+		}
+		ret = rbull_init_zones(dev);
+		if (ret)
+			goto free_hctx;
+	}
+
+	/* nothing is allocated up front: a disk of any size loads at once */
+	xa_init(&dev->pages);
+	atomic_long_set(&dev->nr_pages, 0);
 	/* Initialize the tag set */
 	memset(&dev->tag_set, 0, sizeof(struct blk_mq_tag_set));
 	dev->tag_set.ops = &rbull_mq_ops;
-	dev->tag_set.nr_hw_queues = nr_hw_queues; // only maps to how many cpu's are there rest are unused
+	dev->tag_set.nr_hw_queues = dev->nr_queues + dev->nr_poll_queues; // only maps to how many cpu's are there rest are unused
 	dev->tag_set.queue_depth = queue_depth; // 256 commands/requests per tag's
-	dev->tag_set.numa_node = NUMA_NO_NODE;
+	/* per-hctx tags and requests already go to the hctx's node, this is for the rest */
+	dev->tag_set.numa_node = home_node;
 	dev->tag_set.cmd_size = sizeof(struct rbull_rq_ctx); // request's private data
-	dev->tag_set.nr_maps = 1; // default no polling cpu to hwctx maps
+	/* default, read (left empty) and poll maps; blk-mq enables polling once the poll map has queues */
+	dev->tag_set.nr_maps = dev->nr_poll_queues ? HCTX_MAX_TYPES : 1;
 	dev->tag_set.driver_data = dev;
+	/* no BLK_MQ_F_BLOCKING: the inline and poll paths never sleep, the worker does that */
 	/* allocate or tell blk-mq to create queues and mappings*/
 	ret = blk_mq_alloc_tag_set(&dev->tag_set);
-	if (ret < 0) goto free_data;
+	if (ret < 0) goto free_zones;
 	ret = setup_queue_limit(dev);
 	if (ret) goto free_tag_set;
 
@@ -365,6 +1490,15 @@ static int __init rbull_init(void){
 	snprintf(dev->disk->disk_name, sizeof(dev->disk->disk_name), "rbull%d", rbull_major);
 	memcpy(dev->disk->disk_name, "rbull0", sizeof("rbull0"));
 	set_capacity(dev->disk, dev->capacity_sectors); // this sets the size of the whole disk
+#ifdef CONFIG_BLK_DEV_ZONED
+	/* the block layer reads every zone back through report_zones before the disk goes live */
+	if (dev->zones)
+	{
+		ret = blk_revalidate_disk_zones(dev->disk);
+		if (ret)
+			goto free_disk;
+	}
+#endif
 	ret = add_disk(dev->disk);
 	if (ret < 0)
 	{
@@ -373,16 +1507,27 @@ static int __init rbull_init(void){
 		return ret;
 
 	}
+	/* debugfs is best effort: a failure only means no stats files */
+	mutex_lock(&dev->disk->queue->debugfs_mutex);
+	dev->debugfs_stats = debugfs_create_file("stats", 0444, dev->disk->queue->debugfs_dir, dev,
+						 &rbull_stats_fops);
+	dev->debugfs_reset = debugfs_create_file("reset", 0200, dev->disk->queue->debugfs_dir, dev,
+						 &rbull_reset_fops);
+	mutex_unlock(&dev->disk->queue->debugfs_mutex);
 	return 0;
 
 	free_disk:
 	    put_disk(dev->disk);
 	free_tag_set: // never attached to the system
 		blk_mq_free_tag_set(&dev->tag_set);
-	free_data:
-		vfree(dev->data);
+	free_zones:
+		kvfree(dev->zones);
 	free_hctx:
 		kfree(dev->hctxs);
+	free_locks:
+		kfree(dev->model.busy);
+		percpu_free_rwsem(&dev->all_locks);
+		kfree(dev->locks);
 
 	return ret;
 }
@@ -391,11 +1536,20 @@ static void __exit rbull_exit(void)
 {
 
 	struct rbull_dev *dev = &r_dev;
+	/* ours only, before the hctxs holding the stats go away; del_gendisk drops the dir */
+	mutex_lock(&dev->disk->queue->debugfs_mutex);
+	debugfs_remove(dev->debugfs_stats);
+	debugfs_remove(dev->debugfs_reset);
+	mutex_unlock(&dev->disk->queue->debugfs_mutex);
 	del_gendisk(dev->disk);
 	put_disk(dev->disk);
 	blk_mq_free_tag_set(&dev->tag_set);
-	vfree(dev->data);
+	rbull_free_pages(dev);
+	kvfree(dev->zones);
 	kfree(dev->hctxs);
+	kfree(dev->model.busy);
+	percpu_free_rwsem(&dev->all_locks);
+	kfree(dev->locks);
 }
 module_init(rbull_init)
 module_exit(rbull_exit)
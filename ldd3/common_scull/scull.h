@@ -4,6 +4,10 @@
 #include <linux/semaphore.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/xarray.h>
+#include <linux/refcount.h>
 
 #define SCULL_MAJOR 0
 #define SCULL_MINOR 0
@@ -16,6 +20,7 @@ extern int scull_minor;
 extern int scull_nr_devs;
 extern int scull_qset;
 extern int scull_quantum;
+extern char *scull_backing;
 
 
 
@@ -36,19 +41,40 @@ struct scull_dev{
     struct cdev cdev;
     /* Added for ch15 - scullv*/
     int vmas;
+    /* Added for ch06 - access policies, see scull_access_control.c */
+    atomic64_t access; // {owner uid, policy, open count}, only changed by cmpxchg
+    wait_queue_head_t access_wait; // wuid openers waiting for another user to leave
+    struct xarray priv_devs; // private instances of this device (tty or process keyed)
+    /* Added for ch06 - lazy private instances */
+    struct scull_dev *template; // frozen copy: quanta this device never wrote are read from here
+    struct scull_dev *frozen; // copy of this device handed to lazy clones, dropped when it changes
+    refcount_t refs; // of a frozen copy: the device it was taken of, and every clone reading it
+    unsigned long mem; // bytes allocated for quanta and qset arrays
+    atomic_long_t *mem_pool; // if set, mem is also charged here
 
 
 };
 
 extern const struct file_operations scull_fops;  // used by main.c
 
+extern struct scull_dev *scull_devices; // the module's scull%d devices, scull_nr_devs of them
+
 int scull_dev_reset(struct scull_dev *);
+void scull_charge(struct scull_dev *dev, long bytes);
+struct scull_dev *scull_freeze(struct scull_dev *dev, atomic_long_t *pool);
+void scull_frozen_put(struct scull_dev *snap);
+int scull_checkpoint(struct scull_dev *devs, int nr);
+int scull_restore(struct scull_dev *devs, int nr);
 int scull_open(struct inode *, struct file *);
 int scull_release(struct inode *, struct file *);
 ssize_t scull_read(struct file *, char __user *, size_t, loff_t *);
 ssize_t scull_write(struct file *, const char __user *, size_t, loff_t *);
 loff_t scull_llseek(struct file *, loff_t, int );
 long scull_ioctl(struct file *, unsigned int, unsigned long );
+struct scull_batch;
+/* SCULL_IOCBATCH on dev; room, if set, is asked before every write entry and may refuse it */
+long scull_do_batch(struct file *, struct scull_dev *, struct scull_batch __user *,
+                    int (*room)(struct scull_dev *));
 struct scull_qset *scull_find_item(struct scull_dev *dev, int item);
 
 #define SCULL_IOC_MAGIC 'k' /* MAGIC Number representing a scull ioctl cmd */
@@ -70,6 +96,48 @@ struct scull_qset *scull_find_item(struct scull_dev *dev, int item);
 #define SCULL_IOCXQSET _IOWR(SCULL_IOC_MAGIC, 10, int) /* "eXchange" qset - atomic get and set */
 #define SCULL_IOCHQUANTUM _IO(SCULL_IOC_MAGIC, 11) /* "sHift" - toggling behavior */
 #define SCULL_IOCHQSET _IO(SCULL_IOC_MAGIC, 12) /* "sHift" - toggling behavior */
-#define SCULL_IOC_MAXNR 14
+/* Access policy of one scull minor, switched at runtime (CAP_SYS_ADMIN, and the caller's
+ * fd must be its only open). Only minors opened through scull_access_fops enforce it */
+enum scull_access_policy {
+    SCULL_ACCESS_NONE,   /* plain scull */
+    SCULL_ACCESS_SINGLE, /* one open at a time */
+    SCULL_ACCESS_UID,    /* one user at a time, others get -EBUSY */
+    SCULL_ACCESS_WUID,   /* one user at a time, others wait */
+    SCULL_ACCESS_PRIV,   /* data private to each controlling tty */
+    SCULL_ACCESS_PROC,   /* data private to each process */
+    SCULL_ACCESS_OPEN,   /* data private to each open, gone at close */
+    SCULL_ACCESS_NR
+};
+#define SCULL_IOCTACCESS _IO(SCULL_IOC_MAGIC, 13) /* "Tell" access policy via arg value */
+#define SCULL_IOCQACCESS _IO(SCULL_IOC_MAGIC, 14) /* "Query" access policy via return value */
+
+/* SCULL_IOCBATCH: many operations for one syscall and one trip through dev->sem */
+enum scull_batch_op {
+    SCULL_OP_READ,  /* read len bytes at off into buf */
+    SCULL_OP_WRITE, /* write len bytes from buf at off */
+    SCULL_OP_PUNCH, /* free/zero [off, off + len), the size stays */
+    SCULL_OP_RESET, /* drop all data, like an O_WRONLY open */
+};
+struct scull_sqe { /* submission: one operation */
+    __u32 op;        /* enum scull_batch_op */
+    __u32 len;
+    __u64 off;       /* device offset; each entry has its own, f_pos is not used */
+    __u64 buf;       /* user buffer for read/write */
+    __u64 user_data; /* handed back in the completion */
+};
+struct scull_cqe { /* completion: one per submission, same order */
+    __u64 user_data;
+    __s64 res;       /* bytes done, or -errno */
+};
+#define SCULL_BATCH_STOP 0x1 /* stop at the first failed entry */
+struct scull_batch {
+    __u64 sqes;  /* struct scull_sqe[nr] */
+    __u64 cqes;  /* struct scull_cqe[nr] */
+    __u32 nr;
+    __u32 flags; /* SCULL_BATCH_* */
+};
+#define SCULL_IOCBATCH _IOW(SCULL_IOC_MAGIC, 15, struct scull_batch) /* returns completions posted */
+#define SCULL_IOCCHECKPOINT _IO(SCULL_IOC_MAGIC, 16) /* write every device to the scull_backing file */
+#define SCULL_IOC_MAXNR 16
 #endif
 
@@ -2,7 +2,12 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/container_of.h>
+#include <linux/slab.h>
+#include <linux/minmax.h>
+#include <linux/sched/signal.h>
 #include "scull.h"
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
 
 int scull_major = SCULL_MAJOR;
 int scull_minor = SCULL_MINOR;
@@ -12,10 +17,92 @@ int scull_quantum = SCULL_QUANTUM;
 
 
 
+/* account memory allocated (or freed, bytes < 0) for dev's data */
+void scull_charge(struct scull_dev *dev, long bytes)
+{
+    dev->mem += bytes;
+    if (dev->mem_pool)
+        atomic_long_add(bytes, dev->mem_pool);
+}
+
+/* drop a reference to a frozen copy (NULL is fine); the last one frees it */
+void scull_frozen_put(struct scull_dev *snap)
+{
+    if (snap && refcount_dec_and_test(&snap->refs))
+    {
+        scull_dev_reset(snap);
+        kfree(snap);
+    }
+}
+
+/* dev is about to change, dev->sem held: clones made from now on need a new copy */
+static void scull_thaw(struct scull_dev *dev)
+{
+    scull_frozen_put(dev->frozen);
+    dev->frozen = NULL;
+}
+
+/*
+ * Lazy clones: a read-only copy of dev as it is now, with a reference for the caller.
+ * Called with dev->sem held. Every clone made until dev next changes shares one copy,
+ * charged to pool; a clone reads through to it and copies quanta on first write.
+ */
+struct scull_dev *scull_freeze(struct scull_dev *dev, atomic_long_t *pool)
+{
+    struct scull_dev *snap = dev->frozen;
+    struct scull_qset *from, **to;
+    int i;
+
+    if (!snap)
+    {
+        snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+        if (!snap)
+            return ERR_PTR(-ENOMEM);
+        sema_init(&snap->sem, 1);
+        snap->quantum = dev->quantum;
+        snap->qset = dev->qset;
+        snap->size = dev->size;
+        snap->mem_pool = pool;
+        refcount_set(&snap->refs, 1); // dev's, until it changes
+        to = &snap->data;
+        for (from = dev->data; from; from = from->next)
+        {
+            *to = kzalloc(sizeof(**to), GFP_KERNEL);
+            if (!*to)
+                goto fail;
+            if (from->data)
+            {
+                (*to)->data = kcalloc(dev->qset, sizeof(char *), GFP_KERNEL);
+                if (!(*to)->data)
+                    goto fail;
+                scull_charge(snap, dev->qset * sizeof(char *));
+                for (i = 0; i < dev->qset; i++)
+                {
+                    if (!from->data[i])
+                        continue;
+                    (*to)->data[i] = kmemdup(from->data[i], dev->quantum, GFP_KERNEL);
+                    if (!(*to)->data[i])
+                        goto fail;
+                    scull_charge(snap, dev->quantum);
+                }
+            }
+            to = &(*to)->next;
+        }
+        dev->frozen = snap;
+    }
+    refcount_inc(&snap->refs);
+    return snap;
+fail:
+    scull_dev_reset(snap);
+    kfree(snap);
+    return ERR_PTR(-ENOMEM);
+}
+
 int scull_dev_reset(struct scull_dev *dev)
 {
     struct scull_qset *next, *curr;
     int i;
+    trace_scull_dev_reset(dev);
     /* Loop around all qsets */
     for (curr=dev->data; curr; curr=next)
     {
@@ -29,19 +116,48 @@ int scull_dev_reset(struct scull_dev *dev)
                     curr->data[i] = NULL;
                 }
             }
-            next=curr->next;
-            kfree(curr);
-
+            kfree(curr->data);
         }
+        /* a read can leave nodes without a data array: free those too */
+        next=curr->next;
+        kfree(curr);
 
     }
+    scull_charge(dev, -(long)dev->mem);
     dev->size=0;
     dev->quantum = scull_quantum;
     dev->qset = scull_qset;
     dev->data = NULL;
+    /* truncated: nothing is inherited from a template any more, or handed to new clones */
+    scull_frozen_put(dev->template);
+    dev->template = NULL;
+    scull_thaw(dev);
     return 0;
 }
 
+/* Same walk as scull_find_item, without allocating: NULL if the list is shorter */
+static struct scull_qset *scull_lookup_item(struct scull_dev *dev, int item)
+{
+    struct scull_qset *curr = dev->data;
+    int n = item;
+
+    while (curr && --n > 0)
+        curr = curr->next;
+    return curr;
+}
+
+/* Lazy clones: the quantum of the template at the same position, or NULL. Called with tmpl->sem held */
+static void *scull_template_quantum(struct scull_dev *dev, struct scull_dev *tmpl, int item, int s_pos)
+{
+    struct scull_qset *curr;
+
+    /* positions only line up if both use the same geometry */
+    if (tmpl->quantum != dev->quantum || tmpl->qset != dev->qset)
+        return NULL;
+    curr = scull_lookup_item(tmpl, item);
+    return curr && curr->data ? curr->data[s_pos] : NULL;
+}
+
 int scull_open(struct inode *inode, struct file *filp)
 {
     struct scull_dev *device = container_of(inode->i_cdev, struct scull_dev, cdev);
@@ -60,7 +176,7 @@ int scull_release(struct inode *inode,  struct file *filp){return 0;}
 
 struct scull_qset *scull_find_item(struct scull_dev *dev, int item)
 {
-    int n = item;
+    int n = item, allocated = 0;
     struct scull_qset *curr = dev->data;
     /* When the first node in ll is NULL */
     if (!curr)
@@ -68,6 +184,7 @@ struct scull_qset *scull_find_item(struct scull_dev *dev, int item)
         curr = kzalloc(sizeof(struct scull_qset), GFP_KERNEL );
         if (!curr) return NULL;
         dev->data = curr;
+        allocated++;
     }
 
     while (--n > 0)
@@ -76,27 +193,24 @@ struct scull_qset *scull_find_item(struct scull_dev *dev, int item)
         {
             curr->next = kzalloc(sizeof(struct scull_qset), GFP_KERNEL );
             if (!curr->next) return NULL;
+            allocated++;
         }
         curr = curr->next;
 
     }
+    trace_scull_find_item(dev, item, allocated);
     return curr;
 }
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/* Reads and writes below expect dev->sem held: one syscall takes it once, a batch once for all */
+static ssize_t scull_read_locked(struct scull_dev *dev, char __user *buf, size_t count, loff_t *f_pos)
 {
-    struct scull_dev *dev = filp->private_data;
     struct scull_qset *qptr;
     // itemsize: bytes in one quantum set
     int quantum = dev->quantum, qset = dev->qset, itemsize = quantum*qset;
     int item, s_pos, q_pos, rest;
-    ssize_t ret = 0;
-    // interruptible sleep
-    if (down_interruptible(&dev->sem))
-        // if interrupted: like a
-        return -ERESTARTSYS;
     if (*f_pos >= dev->size) // EOF
-        goto out;
+        return 0;
     if (*f_pos + count > dev->size)
         count = dev->size - *f_pos;
     /* Calculate positions */
@@ -104,41 +218,62 @@ ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_
     rest = (long)*f_pos % itemsize; /* offset within the quantum set */
     s_pos = rest / quantum;  /* index of quantum in the set */
     q_pos = rest % quantum; /* offset within that quantum */
-    /* Find the quantum set item position ahead */
-    qptr =  scull_find_item(dev, item);
-    if (qptr == NULL || !qptr->data || !qptr->data[s_pos])
-    {
-        /* No data to read */
-        goto out;
-    }
+    /* Find the quantum set item position ahead, reading never allocates */
+    qptr =  scull_lookup_item(dev, item);
     /* limit read to this quantum's end */
     if (count > quantum - q_pos)
         count = quantum - q_pos;
-    /* Copy data to user space */
-    if (copy_to_user(buf, qptr->data[s_pos] + q_pos, count))
+    if (qptr == NULL || !qptr->data || !qptr->data[s_pos])
     {
-        ret = -EFAULT;
-        goto out;
+        struct scull_dev *tmpl = dev->template;
+        void *src = NULL;
+        int err = 0;
+        /* A hole: zeroes, unless this is a lazy clone of a device that has the data */
+        if (tmpl)
+        {
+            // lock order: a clone, then its template, never the other way round
+            if (down_interruptible(&tmpl->sem))
+                return -ERESTARTSYS;
+            src = scull_template_quantum(dev, tmpl, item, s_pos);
+            if (src && copy_to_user(buf, src + q_pos, count))
+                err = -EFAULT;
+            up(&tmpl->sem);
+        }
+        if (!src && clear_user(buf, count))
+            err = -EFAULT;
+        if (err)
+            return err;
     }
+    /* Copy data to user space */
+    else if (copy_to_user(buf, qptr->data[s_pos] + q_pos, count))
+        return -EFAULT;
     *f_pos = *f_pos + count;
-    ret = count;
+    return count;
+}
 
-out:
+ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct scull_dev *dev = filp->private_data;
+    loff_t pos = *f_pos;
+    ssize_t ret;
+    // interruptible sleep
+    if (down_interruptible(&dev->sem))
+        // if interrupted: like a
+        return -ERESTARTSYS;
+    ret = scull_read_locked(dev, buf, count, f_pos);
     up(&dev->sem);
+    trace_scull_read(dev, pos, count, ret);
     return ret;
 }
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+
+static ssize_t scull_write_locked(struct scull_dev *dev, const char __user *buf, size_t count, loff_t *f_pos)
 {
-    struct scull_dev *dev = filp->private_data;
     struct scull_qset *qptr;
     // itemsize: bytes in one quantum set
     int quantum = dev->quantum, qset = dev->qset, itemsize = quantum*qset;
     int item, s_pos, q_pos, rest;
-    ssize_t ret = -ENOMEM;
-    // interruptible sleep
-    if (down_interruptible(&dev->sem))
-        // if interrupted: like a
-            return -ERESTARTSYS;
+    /* clones already made keep what they were given */
+    scull_thaw(dev);
     /* Calculate positions */
     item = (long)*f_pos / itemsize; /* which quantum set? */
     rest = (long)*f_pos % itemsize; /* offset within the quantum set */
@@ -147,22 +282,35 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, lof
     /* Find the quantum set item position ahead */
     qptr =  scull_find_item(dev, item);
     if (qptr == NULL)
-    {
-        /* No data to read */
-        goto out;
-    }
+        return -ENOMEM;
     if (!qptr->data)
     {
         /* Allocate a qset array*/
         qptr->data = kcalloc(qset, sizeof(char *), GFP_KERNEL);
-        if (!qptr->data) goto out;
+        if (!qptr->data)
+            return -ENOMEM;
+        scull_charge(dev, qset * sizeof(char *));
     }
     /* allocate the specific quantum at [s_pos] if not present */
     if (!qptr->data[s_pos])
     {
+        struct scull_dev *tmpl = dev->template;
+        void *src = NULL;
         qptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-        if (!qptr->data[s_pos]) goto out;
-        memset(qptr->data[s_pos], 0, dev->quantum);
+        if (!qptr->data[s_pos])
+            return -ENOMEM;
+        scull_charge(dev, quantum);
+        /* copy-on-write: the first write to a quantum of a lazy clone takes the template's copy */
+        if (tmpl)
+        {
+            down(&tmpl->sem); // held for one memcpy, not worth failing the write over a signal
+            src = scull_template_quantum(dev, tmpl, item, s_pos);
+            if (src)
+                memcpy(qptr->data[s_pos], src, quantum);
+            up(&tmpl->sem);
+        }
+        if (!src)
+            memset(qptr->data[s_pos], 0, dev->quantum);
     }
 
     /* limit read to this quantum's end */
@@ -170,22 +318,167 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, lof
         count = quantum - q_pos;
     /* Copy data to user space */
     if (copy_from_user(qptr->data[s_pos] + q_pos, buf, count))
-    {
-        ret = -EFAULT;
-        goto out;
-    }
+        return -EFAULT;
     *f_pos = *f_pos + count;
-    ret = count;
     /* update the device size */
     if (dev->size < *f_pos)
     {
         dev->size = *f_pos;
 
     }
-    out:
-        up(&dev->sem);
+    return count;
+}
+
+ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct scull_dev *dev = filp->private_data;
+    loff_t pos = *f_pos;
+    ssize_t ret;
+    // interruptible sleep
+    if (down_interruptible(&dev->sem))
+        // if interrupted: like a
+            return -ERESTARTSYS;
+    ret = scull_write_locked(dev, buf, count, f_pos);
+    up(&dev->sem);
+    trace_scull_write(dev, pos, count, ret);
     return ret;
 }
+
+/*
+ * Punch a hole: free the quanta wholly inside [off, off + len), zero the partial ones at
+ * the edges. The size does not change, the hole reads back as zeroes.
+ */
+static ssize_t scull_punch_locked(struct scull_dev *dev, loff_t off, size_t len)
+{
+    int quantum = dev->quantum, qset = dev->qset, itemsize = quantum*qset;
+    loff_t end = min_t(loff_t, off + len, dev->size);
+    loff_t start = off;
+
+    /* a freed quantum of a lazy clone would show the template through, not zeroes */
+    if (dev->template)
+        return -EOPNOTSUPP;
+    scull_thaw(dev);
+    while (off < end)
+    {
+        int item = (long)off / itemsize, rest = (long)off % itemsize;
+        int s_pos = rest / quantum, q_pos = rest % quantum;
+        size_t n = min_t(loff_t, quantum - q_pos, end - off);
+        struct scull_qset *qptr = scull_lookup_item(dev, item);
+
+        if (qptr && qptr->data && qptr->data[s_pos])
+        {
+            if (n == quantum)
+            {
+                kfree(qptr->data[s_pos]);
+                qptr->data[s_pos] = NULL;
+                scull_charge(dev, -(long)quantum);
+            }
+            else
+                memset(qptr->data[s_pos] + q_pos, 0, n);
+        }
+        off += n;
+    }
+    return off > start ? off - start : 0;
+}
+
+/* one batch entry, with dev->sem held: whole-length reads and writes, not one quantum */
+static s64 scull_batch_one(struct file *filp, struct scull_dev *dev, const struct scull_sqe *sqe,
+                           int (*room)(struct scull_dev *))
+{
+    char __user *buf = u64_to_user_ptr(sqe->buf);
+    loff_t pos = sqe->off;
+    size_t done = 0;
+    ssize_t n = 0;
+
+    if (sqe->op == SCULL_OP_READ ? !(filp->f_mode & FMODE_READ) : !(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (sqe->off > MAX_LFS_FILESIZE - sqe->len)
+        return -EINVAL;
+    switch (sqe->op)
+    {
+    case SCULL_OP_READ:
+        while (done < sqe->len && (n = scull_read_locked(dev, buf + done, sqe->len - done, &pos)) > 0)
+            done += n;
+        trace_scull_read(dev, sqe->off, sqe->len, done ? done : n);
+        break;
+    case SCULL_OP_WRITE:
+        if (room && (n = room(dev)))
+            return n; // over a memory limit: this entry fails like write(2) would
+        while (done < sqe->len && (n = scull_write_locked(dev, buf + done, sqe->len - done, &pos)) > 0)
+            done += n;
+        trace_scull_write(dev, sqe->off, sqe->len, done ? done : n);
+        break;
+    case SCULL_OP_PUNCH:
+        return scull_punch_locked(dev, pos, sqe->len);
+    case SCULL_OP_RESET:
+        return scull_dev_reset(dev);
+    default:
+        return -EINVAL;
+    }
+    // like read(2)/write(2): an error only if nothing was done
+    return done ? done : n;
+}
+
+#define SCULL_BATCH_CHUNK 8 // entries copied in (and completions out) at a time
+
+/*
+ * SCULL_IOCBATCH: run the submission array in order under one dev->sem, posting one
+ * completion per entry. Returns how many entries were completed: fewer than nr if a
+ * signal arrived, or with SCULL_BATCH_STOP after the first failed entry.
+ */
+long scull_do_batch(struct file *filp, struct scull_dev *dev, struct scull_batch __user *ubatch,
+                    int (*room)(struct scull_dev *))
+{
+    struct scull_sqe sqes[SCULL_BATCH_CHUNK];
+    struct scull_cqe cqes[SCULL_BATCH_CHUNK];
+    struct scull_sqe __user *usqe;
+    struct scull_cqe __user *ucqe;
+    struct scull_batch batch;
+    u32 done = 0, i, n;
+    bool stop = false;
+    long ret = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.flags & ~SCULL_BATCH_STOP)
+        return -EINVAL;
+    usqe = u64_to_user_ptr(batch.sqes);
+    ucqe = u64_to_user_ptr(batch.cqes);
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    while (done < batch.nr && !stop)
+    {
+        n = min_t(u32, batch.nr - done, SCULL_BATCH_CHUNK);
+        if (copy_from_user(sqes, usqe + done, n * sizeof(*sqes)))
+        {
+            ret = -EFAULT;
+            break;
+        }
+        for (i = 0; i < n; i++)
+        {
+            cqes[i].user_data = sqes[i].user_data;
+            cqes[i].res = scull_batch_one(filp, dev, &sqes[i], room);
+            if (cqes[i].res < 0 && (batch.flags & SCULL_BATCH_STOP))
+            {
+                stop = true;
+                n = i + 1;
+                break;
+            }
+        }
+        if (copy_to_user(ucqe + done, cqes, n * sizeof(*cqes)))
+        {
+            ret = -EFAULT;
+            break;
+        }
+        done += n;
+        // keep a huge batch killable; what completed so far is reported
+        if (signal_pending(current))
+            break;
+    }
+    up(&dev->sem);
+    return done ? done : ret;
+}
+
 loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 {
     struct scull_dev *dev = filp->private_data;
@@ -319,6 +612,19 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         scull_quantum = arg;
         retval = q;
         break;
+    /* many reads/writes in one call */
+    case SCULL_IOCBATCH:
+        retval = scull_do_batch(filp, filp->private_data, (struct scull_batch __user *)arg, NULL);
+        break;
+    /* every scull device to scull_backing */
+    case SCULL_IOCCHECKPOINT:
+        if (!capable(CAP_SYS_ADMIN))
+        {
+            retval = -EPERM;
+            break;
+        }
+        retval = scull_checkpoint(scull_devices, scull_nr_devs);
+        break;
     default:
     }
     return retval;
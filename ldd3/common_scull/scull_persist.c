@@ -0,0 +1,446 @@
+#include <linux/fs.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/cred.h>
+#include <linux/fadvise.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/minmax.h>
+#include "scull.h"
+
+/*
+ * Persistent scull: SCULL_IOCCHECKPOINT streams every scull device into the file named by
+ * scull_backing, and the module restores them from it at load.
+ *
+ * File layout, all native endian (it only has to survive a module upgrade on the same box):
+ *   scull_ckpt_hdr
+ *   per device: scull_ckpt_dev, then nquanta x { scull_ckpt_quantum, quantum bytes }
+ *   SCULL_CKPT_END, so a torn checkpoint is refused instead of half restored
+ * Only quanta that exist are written: holes stay holes.
+ * scull_backing must be an absolute path. A checkpoint goes to <scull_backing>.tmp first and is renamed over scull_backing only once
+ * it is complete and synced, so a failed checkpoint leaves the previous one in place.
+ */
+#define SCULL_CKPT_MAGIC 0x53434b50 /* "SCKP" */
+#define SCULL_CKPT_END 0x53434b45 /* "SCKE" */
+#define SCULL_CKPT_VERSION 1
+#define SCULL_CKPT_CHUNK (1 << 20) // bytes staged per kernel_write/kernel_read
+
+struct scull_ckpt_hdr {
+    u32 magic;
+    u32 version;
+    u32 nr_devs;
+    u32 pad;
+};
+struct scull_ckpt_dev {
+    u32 quantum;
+    u32 qset;
+    u64 size;
+    u64 nquanta;
+};
+struct scull_ckpt_quantum {
+    u32 node; // position of the qset node in the list, from 0
+    u32 s_pos; // index of the quantum in its node
+};
+
+char *scull_backing;
+
+static DEFINE_MUTEX(scull_ckpt_lock); // one checkpoint at a time
+
+/* a staging buffer in front of the backing file, so the file sees large sequential I/O */
+struct scull_ckpt_io {
+    struct file *file;
+    loff_t pos; // file offset of buf[0]
+    char *buf;
+    size_t len; // bytes staged (write) or valid (read)
+    size_t off; // bytes consumed (read)
+};
+
+static int scull_ckpt_flush(struct scull_ckpt_io *io)
+{
+    size_t done = 0;
+
+    while (done < io->len)
+    {
+        ssize_t n = kernel_write(io->file, io->buf + done, io->len - done, &io->pos);
+        if (n < 0)
+            return n;
+        if (n == 0)
+            return -EIO;
+        done += n;
+    }
+    io->len = 0;
+    return 0;
+}
+
+static int scull_ckpt_put(struct scull_ckpt_io *io, const void *p, size_t n)
+{
+    while (n)
+    {
+        size_t c = min_t(size_t, n, SCULL_CKPT_CHUNK - io->len);
+        memcpy(io->buf + io->len, p, c);
+        io->len += c;
+        p += c;
+        n -= c;
+        if (io->len == SCULL_CKPT_CHUNK)
+        {
+            int err = scull_ckpt_flush(io);
+            if (err)
+                return err;
+        }
+    }
+    return 0;
+}
+
+static int scull_ckpt_get(struct scull_ckpt_io *io, void *p, size_t n)
+{
+    while (n)
+    {
+        size_t c;
+        if (io->off == io->len)
+        {
+            ssize_t r = kernel_read(io->file, io->buf, SCULL_CKPT_CHUNK, &io->pos);
+            if (r < 0)
+                return r;
+            if (r == 0)
+                return -EINVAL; // truncated file
+            io->len = r;
+            io->off = 0;
+        }
+        c = min_t(size_t, n, io->len - io->off);
+        memcpy(p, io->buf + io->off, c);
+        io->off += c;
+        p += c;
+        n -= c;
+    }
+    return 0;
+}
+
+static int scull_checkpoint_dev(struct scull_ckpt_io *io, struct scull_dev *dev)
+{
+    struct scull_ckpt_dev d;
+    struct scull_ckpt_quantum q;
+    struct scull_qset *curr;
+    int i, err = 0;
+
+    // the device stays consistent while it is written, other devices keep running
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    d.quantum = dev->quantum;
+    d.qset = dev->qset;
+    d.size = dev->size;
+    d.nquanta = 0;
+    for (curr = dev->data; curr; curr = curr->next)
+        for (i = 0; curr->data && i < dev->qset; i++)
+            d.nquanta += !!curr->data[i];
+    err = scull_ckpt_put(io, &d, sizeof(d));
+    for (q.node = 0, curr = dev->data; curr && !err; q.node++, curr = curr->next)
+    {
+        for (q.s_pos = 0; curr->data && q.s_pos < dev->qset && !err; q.s_pos++)
+        {
+            if (!curr->data[q.s_pos])
+                continue;
+            err = scull_ckpt_put(io, &q, sizeof(q));
+            if (!err)
+                err = scull_ckpt_put(io, curr->data[q.s_pos], dev->quantum);
+        }
+    }
+    up(&dev->sem);
+    return err;
+}
+
+/*
+ * scull_backing must be an absolute path naming a file: a relative one would be resolved
+ * against the cwd of whoever loads the module or asks for a checkpoint
+ */
+static bool scull_ckpt_path_ok(void)
+{
+    return scull_backing[0] == '/' && *kbasename(scull_backing);
+}
+
+/* move the finished tmp file over scull_backing, both in the same directory */
+static int scull_ckpt_replace(const char *tmp)
+{
+    struct renamedata rd = {};
+    struct path dpath;
+    struct dentry *dir, *old, *new, *trap;
+    struct file *f;
+    char *dname;
+    int err;
+
+    // the directory: scull_backing up to its last '/', or "/" itself
+    dname = kstrndup(scull_backing, kbasename(scull_backing) - scull_backing, GFP_KERNEL);
+    if (!dname)
+        return -ENOMEM;
+    if (strlen(dname) > 1)
+        dname[strlen(dname) - 1] = '\0';
+    err = kern_path(dname, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &dpath);
+    kfree(dname);
+    if (err)
+        return err;
+    err = mnt_want_write(dpath.mnt);
+    if (err)
+        goto put_dir;
+    dir = dpath.dentry;
+    trap = lock_rename(dir, dir);
+    if (IS_ERR(trap))
+    {
+        err = PTR_ERR(trap);
+        goto drop_write;
+    }
+    // both names looked up under the locked directory: the target may not exist yet
+    old = lookup_one(mnt_idmap(dpath.mnt), &QSTR(kbasename(tmp)), dir);
+    if (IS_ERR(old))
+    {
+        err = PTR_ERR(old);
+        goto unlock;
+    }
+    new = lookup_one(mnt_idmap(dpath.mnt), &QSTR(kbasename(scull_backing)), dir);
+    if (IS_ERR(new))
+    {
+        err = PTR_ERR(new);
+        goto put_old;
+    }
+    err = -ENOENT; // the tmp file was unlinked under us
+    if (d_really_is_positive(old))
+    {
+        rd.old_mnt_idmap = rd.new_mnt_idmap = mnt_idmap(dpath.mnt);
+        rd.old_dir = rd.new_dir = d_inode(dir);
+        rd.old_dentry = old;
+        rd.new_dentry = new;
+        err = vfs_rename(&rd);
+    }
+    dput(new);
+put_old:
+    dput(old);
+unlock:
+    unlock_rename(dir, dir);
+    if (!err)
+    {
+        // the rename itself must survive a crash too
+        f = dentry_open(&dpath, O_RDONLY | O_DIRECTORY, current_cred());
+        if (!IS_ERR(f))
+        {
+            vfs_fsync(f, 0);
+            fput(f);
+        }
+    }
+drop_write:
+    mnt_drop_write(dpath.mnt);
+put_dir:
+    path_put(&dpath);
+    return err;
+}
+
+int scull_checkpoint(struct scull_dev *devs, int nr)
+{
+    struct scull_ckpt_hdr hdr = {
+        .magic = SCULL_CKPT_MAGIC, .version = SCULL_CKPT_VERSION, .nr_devs = nr,
+    };
+    struct scull_ckpt_io io = {};
+    u32 end = SCULL_CKPT_END;
+    char *tmp;
+    int i, err;
+
+    if (!scull_backing || !*scull_backing || !scull_ckpt_path_ok())
+        return -EINVAL;
+    tmp = kasprintf(GFP_KERNEL, "%s.tmp", scull_backing);
+    io.buf = kvmalloc(SCULL_CKPT_CHUNK, GFP_KERNEL);
+    if (!io.buf || !tmp)
+    {
+        kvfree(io.buf);
+        kfree(tmp);
+        return -ENOMEM;
+    }
+    mutex_lock(&scull_ckpt_lock);
+    // never truncate the good checkpoint: a torn one would make the next load start empty
+    io.file = filp_open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+    if (IS_ERR(io.file))
+    {
+        err = PTR_ERR(io.file);
+        goto out;
+    }
+    err = scull_ckpt_put(&io, &hdr, sizeof(hdr));
+    for (i = 0; i < nr && !err; i++)
+        err = scull_checkpoint_dev(&io, &devs[i]);
+    if (!err)
+        err = scull_ckpt_put(&io, &end, sizeof(end));
+    if (!err)
+        err = scull_ckpt_flush(&io);
+    if (!err)
+        err = vfs_fsync(io.file, 0);
+    filp_close(io.file, NULL);
+    // on failure the old checkpoint is untouched, the .tmp is overwritten next time
+    if (!err)
+        err = scull_ckpt_replace(tmp);
+    if (!err)
+        pr_info("scull: checkpointed %d devices, %lld bytes to %s\n", nr, io.pos, scull_backing);
+out:
+    mutex_unlock(&scull_ckpt_lock);
+    kvfree(io.buf);
+    kfree(tmp);
+    return err;
+}
+
+/* the list up to node, allocating what is missing; tail caches the last node we reached */
+static struct scull_qset *scull_restore_node(struct scull_dev *dev, struct scull_qset **tail,
+                                             u32 *tail_node, u32 node)
+{
+    struct scull_qset **link = *tail ? &(*tail)->next : &dev->data;
+
+    if (*tail && *tail_node == node)
+        return *tail;
+    if (*tail && *tail_node > node)
+        return NULL; // records are written in list order
+    for (;;)
+    {
+        if (!*link)
+        {
+            *link = kzalloc(sizeof(**link), GFP_KERNEL);
+            if (!*link)
+                return ERR_PTR(-ENOMEM);
+        }
+        *tail_node = *tail ? *tail_node + 1 : 0;
+        *tail = *link;
+        if (*tail_node == node)
+            return *tail;
+        link = &(*tail)->next;
+    }
+}
+
+/* one device from the file into dev, or past it if dev is NULL */
+static int scull_restore_dev(struct scull_ckpt_io *io, struct scull_dev *dev)
+{
+    struct scull_ckpt_dev d;
+    struct scull_ckpt_quantum q;
+    struct scull_qset *tail = NULL, *node;
+    u32 tail_node = 0;
+    void *skip = NULL;
+    u64 i;
+    int err;
+
+    err = scull_ckpt_get(io, &d, sizeof(d));
+    if (err)
+        return err;
+    if (!d.quantum || !d.qset || d.quantum > INT_MAX / d.qset)
+        return -EINVAL;
+    if (dev)
+    {
+        down(&dev->sem);
+        scull_dev_reset(dev);
+        dev->quantum = d.quantum;
+        dev->qset = d.qset;
+        dev->size = d.size;
+    }
+    else
+    {
+        // a device this module instance does not have: read past its data
+        skip = kvmalloc(d.quantum, GFP_KERNEL);
+        if (!skip)
+            err = -ENOMEM;
+    }
+    for (i = 0; i < d.nquanta && !err; i++)
+    {
+        err = scull_ckpt_get(io, &q, sizeof(q));
+        if (err)
+            break;
+        if (!dev)
+        {
+            err = scull_ckpt_get(io, skip, d.quantum);
+            continue;
+        }
+        node = q.s_pos < d.qset ? scull_restore_node(dev, &tail, &tail_node, q.node) : NULL;
+        if (IS_ERR_OR_NULL(node))
+        {
+            err = node ? PTR_ERR(node) : -EINVAL;
+            break;
+        }
+        if (!node->data)
+        {
+            node->data = kcalloc(d.qset, sizeof(char *), GFP_KERNEL);
+            if (!node->data)
+            {
+                err = -ENOMEM;
+                break;
+            }
+            scull_charge(dev, d.qset * sizeof(char *));
+        }
+        if (node->data[q.s_pos])
+        {
+            err = -EINVAL;
+            break;
+        }
+        node->data[q.s_pos] = kmalloc(d.quantum, GFP_KERNEL);
+        if (!node->data[q.s_pos])
+        {
+            err = -ENOMEM;
+            break;
+        }
+        scull_charge(dev, d.quantum);
+        err = scull_ckpt_get(io, node->data[q.s_pos], d.quantum);
+    }
+    if (dev)
+    {
+        // never leave half a device behind
+        if (err)
+            scull_dev_reset(dev);
+        up(&dev->sem);
+    }
+    kvfree(skip);
+    return err;
+}
+
+/* Load devs from scull_backing, called at module init. A missing file is not an error */
+int scull_restore(struct scull_dev *devs, int nr)
+{
+    struct scull_ckpt_hdr hdr;
+    struct scull_ckpt_io io = {};
+    u32 end;
+    int i, err;
+
+    if (!scull_backing || !*scull_backing)
+        return 0;
+    if (!scull_ckpt_path_ok())
+        return -EINVAL;
+    io.file = filp_open(scull_backing, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(io.file))
+    {
+        err = PTR_ERR(io.file);
+        return err == -ENOENT ? 0 : err;
+    }
+    io.buf = kvmalloc(SCULL_CKPT_CHUNK, GFP_KERNEL);
+    if (!io.buf)
+    {
+        err = -ENOMEM;
+        goto out;
+    }
+    // the whole file is read once front to back: start readahead on all of it now,
+    // so the disk works ahead while we copy into quanta
+    vfs_fadvise(io.file, 0, 0, POSIX_FADV_SEQUENTIAL);
+    vfs_fadvise(io.file, 0, 0, POSIX_FADV_WILLNEED);
+    err = scull_ckpt_get(&io, &hdr, sizeof(hdr));
+    if (!err && (hdr.magic != SCULL_CKPT_MAGIC || hdr.version != SCULL_CKPT_VERSION))
+        err = -EINVAL;
+    for (i = 0; i < hdr.nr_devs && !err; i++)
+        err = scull_restore_dev(&io, i < nr ? &devs[i] : NULL);
+    if (!err)
+        err = scull_ckpt_get(&io, &end, sizeof(end));
+    if (!err && end != SCULL_CKPT_END)
+        err = -EINVAL;
+    if (err)
+    {
+        // torn or foreign file: start empty rather than with some devices restored
+        for (i = 0; i < nr; i++)
+        {
+            down(&devs[i].sem);
+            scull_dev_reset(&devs[i]);
+            up(&devs[i].sem);
+        }
+    }
+    else
+        pr_info("scull: restored %d devices from %s\n", min_t(int, hdr.nr_devs, nr), scull_backing);
+out:
+    kvfree(io.buf);
+    filp_close(io.file, NULL);
+    return err;
+}
@@ -0,0 +1,88 @@
+/*
+ * Tracepoints for the scull core: ftrace/perf see them under events/scull/, and they cost
+ * a patched-out branch while disabled, unlike a printk on every read and write.
+ *   perf trace -e 'scull:*'   or   echo 1 > /sys/kernel/tracing/events/scull/enable
+ * Private instances (scull_access_control.c) have no cdev of their own and show up as dev=0:0.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "scull.h"
+
+DECLARE_EVENT_CLASS(scull_rw,
+    TP_PROTO(struct scull_dev *dev, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(dev, pos, count, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->cdev.dev;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev=%d:%d pos=%lld count=%zu ret=%zd", MAJOR(__entry->devt), MINOR(__entry->devt),
+              __entry->pos, __entry->count, __entry->ret)
+);
+
+/* one read(2)/write(2), or one SCULL_IOCBATCH entry */
+DEFINE_EVENT(scull_rw, scull_read,
+    TP_PROTO(struct scull_dev *dev, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(dev, pos, count, ret)
+);
+DEFINE_EVENT(scull_rw, scull_write,
+    TP_PROTO(struct scull_dev *dev, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(dev, pos, count, ret)
+);
+
+/* the list walk of a write: long walks and allocations are what make big offsets slow */
+TRACE_EVENT(scull_find_item,
+    TP_PROTO(struct scull_dev *dev, int item, int allocated),
+    TP_ARGS(dev, item, allocated),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(int, item)
+        __field(int, allocated)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->cdev.dev;
+        __entry->item = item;
+        __entry->allocated = allocated;
+    ),
+    TP_printk("dev=%d:%d item=%d allocated=%d", MAJOR(__entry->devt), MINOR(__entry->devt),
+              __entry->item, __entry->allocated)
+);
+
+/* everything dropped: size before, bytes freed */
+TRACE_EVENT(scull_dev_reset,
+    TP_PROTO(struct scull_dev *dev),
+    TP_ARGS(dev),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(unsigned long, size)
+        __field(unsigned long, mem)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->cdev.dev;
+        __entry->size = dev->size;
+        __entry->mem = dev->mem;
+    ),
+    TP_printk("dev=%d:%d size=%lu freed=%lu", MAJOR(__entry->devt), MINOR(__entry->devt),
+              __entry->size, __entry->mem)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+/* found through the -I of the source directories kmod_target passes */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>